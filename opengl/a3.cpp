@@ -1,7 +1,14 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #ifdef __APPLE__
 #  include <GLUT/glut.h>
@@ -9,9 +16,13 @@
 #  include <GL/glut.h>
 #endif
 
+#include "check.hpp"
 #include "linalg.hpp"
 #include "mygl.hpp"
 #include "scenario.hpp"
+#include "scenefile.hpp"
+#include "stream.hpp"
+#include "trace.hpp"
 
 
 // Dimensions of the window we are drawing into.
@@ -21,22 +32,88 @@ static int realHeight = 400;
 // The size of our virtual pizels.
 static int virtualPixelSize = 4;
 
-// The scene that is displayed; starts with the most basic scene.
-static int currentScene = 0;
+// Everything that determines what the scene draws. The GLUT thread keeps
+// `requested` up to date with input (under frameMutex), and the render thread
+// takes a copy of it as late as possible before drawing each frame.
+struct FrameState {
+    Vector cameraPosition;
+    Vector cameraFocus;
+    bool usePerspective;
+    bool perspectiveCorrectTextures;
+    int perspectiveSpanLength;
+    bool drawAsPoints;
+    bool multisampling;
+    bool lighting;
+    int queueMode;
+    int scene;
+    int virtualWidth;
+    int virtualHeight;
+};
+static FrameState requested;
+
+// How each of mygl's queue modes (see myBeginQueue) is described.
+static int const queueModeCount = 4;
+static char const *queueModeNames[queueModeCount] = {
+    "state sorted", "front to back", "with a depth prepass", "with a visibility buffer"
+};
+
+// Display lists holding each static scene, or 0 if not yet recorded. Only
+// used by the render thread.
+static std::vector<int> sceneLists;
+
+// Is the virtual pixel grid drawn over the scene?
+static bool gridIsVisible = false;
 
 // Flags to control some parts of the drawing pipeline. These are not static
-// as they are also used in mygl.cpp.
-bool gridIsVisible = false;
+// as they are also used in mygl.cpp. The first four are only touched by the
+// render thread, which copies them from its FrameState.
 bool perspectiveCorrectTextures = true;
+int perspectiveSpanLength = 0;
 bool drawAsPoints = false;
+bool multisampling = false;
+bool usePixelBuffers = true;
 
 // Which OBJ to display for scene H. Not static so it can be used in scenarios.cpp
 std::string objFilename("teapot.obj");
 
-// External camera attributes.
-static Vector cameraPosition;
-static Vector cameraFocus;
-static bool usePerspective;
+// Print how long the parts of each frame took?
+static std::atomic<bool> reportFrameTimes(false);
+
+// Where a trace is written when recording is turned off, or on exit.
+static char const *traceFilename = "a3-trace.json";
+
+// Show the pipeline statistics over the scene?
+static bool statsAreVisible = false;
+
+// The pipeline statistics, and total time in milliseconds, for the frame in
+// each color buffer.
+static MyStats frameStats[MYGL_COLOR_BUFFERS];
+static double frameTimes[MYGL_COLOR_BUFFERS];
+
+// Frames are drawn on a render thread into one of the virtual color buffers,
+// while the GLUT thread shows the most recently finished one. Everything
+// below is guarded by frameMutex.
+static std::mutex frameMutex;
+static std::condition_variable frameRequestedSignal;
+static std::thread renderThread;
+
+// Has input changed since the render thread last looked? Is it drawing right
+// now? Should it stop?
+static bool frameRequested = false;
+static bool rendering = false;
+static bool quitting = false;
+
+// The color buffer being shown, and the one finished since (or -1 if none).
+static int presentedBuffer = -1;
+static int readyBuffer = -1;
+
+// Is a GLUT timer polling for finished frames?
+static bool polling = false;
+
+// A hash of everything that went into the last frame drawn by the scene, so
+// we can tell when it would come out the same. Only used by the render
+// thread.
+static unsigned long long lastFrameHash = 0;
 
 // The most recently seen mouse coordinates.
 static int mouseX;
@@ -58,10 +135,32 @@ static void initOpenGL(void) {
     // that points drawn later at the same depth override earlier ones.
     glEnable(GL_DEPTH_TEST);
     glDepthFunc(GL_LEQUAL);
+}
+
+
+// Called by GLUT when a timer started by requestFrame() fires; shows any
+// frame the render thread has finished, and keeps polling while it is busy.
+static void pollFrames(int) {
+    std::lock_guard<std::mutex> lock(frameMutex);
+    if (readyBuffer >= 0) {
+        glutPostRedisplay();
+    }
+    if (frameRequested || rendering) {
+        glutTimerFunc(1, pollFrames, 0);
+    } else {
+        polling = false;
+    }
+}
+
 
-    // Initialize the point size to our virtual pixel size; we will draw
-    // points as virtual pixels.
-    glPointSize(virtualPixelSize);
+// Tells the render thread that input has changed. Call with frameMutex held.
+static void requestFrame() {
+    frameRequested = true;
+    frameRequestedSignal.notify_one();
+    if (!polling) {
+        polling = true;
+        glutTimerFunc(1, pollFrames, 0);
+    }
 }
 
 
@@ -75,22 +174,25 @@ static void reshape(int w, int h) {
     // We want to draw into the whole window.
     glViewport(0, 0, w, h);
 
-    // Calculate the virtual size of the window, and set it.
-    double virtualWidth = realWidth / virtualPixelSize;
-    double virtualHeight = realHeight / virtualPixelSize;
-    myViewport(virtualWidth, virtualHeight);
-
-    // Setup the projection matrix to map our virtual buffer into the real
-    // window.
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(-0.5, virtualWidth - 0.5, -0.5, virtualHeight - 0.5, -1, 1);
+    // Calculate the virtual size of the window, and ask for a frame that size.
+    std::lock_guard<std::mutex> lock(frameMutex);
+    requested.virtualWidth = realWidth / virtualPixelSize;
+    requested.virtualHeight = realHeight / virtualPixelSize;
+    requestFrame();
 
     // Signal to GLUT that we need a redraw.
     glutPostRedisplay();
 }
 
 
+// Milliseconds since an arbitrary fixed point in time.
+static double now() {
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+
 // Called by GLUT when you click the mouse.
 // Simply saving mouse coords.
 void mouseClick(int button, int state, int x, int y) {
@@ -111,6 +213,10 @@ void mouseMove(int x, int y) {
     int dx = x - mouseX;
     int dy = y - mouseY;
 
+    std::lock_guard<std::mutex> lock(frameMutex);
+    Vector &cameraPosition = requested.cameraPosition;
+    Vector &cameraFocus = requested.cameraFocus;
+
     // Offset from the camera's focus to its position.
     Vector camOffset = cameraPosition - cameraFocus;
 
@@ -142,18 +248,34 @@ void mouseMove(int x, int y) {
     mouseX = x;
     mouseY = y;
 
-    glutPostRedisplay();
+    requestFrame();
+}
+
+
+// Stops the render thread, waiting for it to finish its frame.
+static void stopRenderThread() {
+    {
+        std::lock_guard<std::mutex> lock(frameMutex);
+        quitting = true;
+        frameRequestedSignal.notify_one();
+    }
+    if (renderThread.joinable()) {
+        renderThread.join();
+    }
 }
 
 
 // Called by GLUT when you press a key on the keyboard.
 static void keyboard(unsigned char key, int x, int y) {
 
+    std::unique_lock<std::mutex> lock(frameMutex);
+
     switch(key) {
 
         // Quit.
         case 27: // escape
         case 'q':
+            lock.unlock();
             exit(0);
             break;
 
@@ -166,16 +288,18 @@ static void keyboard(unsigned char key, int x, int y) {
         case '/':
             gridIsVisible = false;
             virtualPixelSize = 1;
-            glPointSize(virtualPixelSize);
+            lock.unlock();
             reshape(realWidth, realHeight);
+            lock.lock();
             break;
 
         // Decrease pixel size.
         case '<':
             if (virtualPixelSize > 1) {
                 virtualPixelSize -= 1;
-                glPointSize(virtualPixelSize);
+                lock.unlock();
                 reshape(realWidth, realHeight);
+                lock.lock();
             }
             break;
 
@@ -183,71 +307,444 @@ static void keyboard(unsigned char key, int x, int y) {
         case '>':
             if (virtualPixelSize < 40) {
                 virtualPixelSize += 2;
-                glPointSize(virtualPixelSize);
+                lock.unlock();
                 reshape(realWidth, realHeight);
+                lock.lock();
             }
             break;
 
         // Toggle a couple flags.
         case 't':
-            perspectiveCorrectTextures = !perspectiveCorrectTextures;
+            requested.perspectiveCorrectTextures = !requested.perspectiveCorrectTextures;
+            break;
+        case 'y':
+            // Cycle between exact perspective correction and correcting
+            // every 8 or 16 pixels.
+            if (requested.perspectiveSpanLength == 0) {
+                requested.perspectiveSpanLength = 8;
+            } else if (requested.perspectiveSpanLength == 8) {
+                requested.perspectiveSpanLength = 16;
+            } else {
+                requested.perspectiveSpanLength = 0;
+            }
             break;
         case 'p':
-            drawAsPoints = !drawAsPoints;
+            requested.drawAsPoints = !requested.drawAsPoints;
+            break;
+        case 'x':
+            requested.multisampling = !requested.multisampling;
+            break;
+        case 'l':
+            requested.lighting = !requested.lighting;
+            break;
+        case 'm':
+            requested.queueMode = (requested.queueMode + 1) % queueModeCount;
+            fprintf(stderr, "drawing %s\n", queueModeNames[requested.queueMode]);
             break;
         case 'o':
-            usePerspective = !usePerspective;
+            requested.usePerspective = !requested.usePerspective;
+            break;
+        case 'v':
+            reportFrameTimes = !reportFrameTimes;
+            break;
+        case 'u':
+            usePixelBuffers = !usePixelBuffers;
+            break;
+        case 's':
+            statsAreVisible = !statsAreVisible;
+            break;
+
+        // Start recording a trace, or stop and write it out.
+        case 'r':
+            if (!traceIsEnabled()) {
+                traceEnable(true);
+                fprintf(stderr, "recording trace\n");
+            } else {
+                traceEnable(false);
+                traceWrite(traceFilename);
+                fprintf(stderr, "trace written to %s\n", traceFilename);
+            }
             break;
 
         // Pick a new scene.
         default:
             if (key - 'a' < scenarios.size()) {
-                currentScene = key - 'a';
-                scenarios[currentScene]->init(
-                    cameraPosition,
-                    cameraFocus,
-                    usePerspective
+                requested.scene = key - 'a';
+                scenarios[requested.scene]->init(
+                    requested.cameraPosition,
+                    requested.cameraFocus,
+                    requested.usePerspective
                 );
             }
             break;
 
     }
 
-    // Signal GLUT that we need a redraw.
+    // Signal the render thread and GLUT that we need a redraw.
+    requestFrame();
     glutPostRedisplay();
 }
 
 
 
-// Called by GLUT when we need to redraw the screen.
-static void display(void) {
+// Mixes the bytes of a value into a running FNV-1a hash.
+template <class T>
+static void hashValue(unsigned long long &hash, T const &value) {
+    unsigned char const *bytes = (unsigned char const*)&value;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+}
+
+
+// Hashes everything that affects what the scene draws: the camera, the
+// projection, the pipeline flags, the scene, and the virtual window size.
+static unsigned long long frameHash(FrameState const &state) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i = 0; i < 3; i++) {
+        hashValue(hash, state.cameraPosition[i]);
+        hashValue(hash, state.cameraFocus[i]);
+    }
+    hashValue(hash, state.usePerspective);
+    hashValue(hash, state.perspectiveCorrectTextures);
+    hashValue(hash, state.perspectiveSpanLength);
+    hashValue(hash, state.drawAsPoints);
+    hashValue(hash, state.multisampling);
+    hashValue(hash, state.lighting);
+    hashValue(hash, state.queueMode);
+    hashValue(hash, state.scene);
+    hashValue(hash, state.virtualWidth);
+    hashValue(hash, state.virtualHeight);
+    return hash;
+}
+
+
+// Draws a frame of the scene into the given color buffer. Runs on the
+// render thread.
+static void drawFrame(FrameState const &state, int buffer) {
+
+    TRACE_SCOPE("drawFrame");
+    double start = now();
 
     // Prepare the myGL environment.
+    perspectiveCorrectTextures = state.perspectiveCorrectTextures;
+    perspectiveSpanLength = state.perspectiveSpanLength;
+    drawAsPoints = state.drawAsPoints;
+    multisampling = state.multisampling;
+    myViewport(state.virtualWidth, state.virtualHeight);
+    myDrawBuffer(buffer);
     myClear();
     myLoadIdentity();
 
     // Perspective projection (if on).
-    if (usePerspective) {
+    if (state.usePerspective) {
         myFrustum(-0.5, 0.5, -0.5, 0.5, 1, 10);
     }
 
     // Setup camera to point at the cameraFocus from the cameraPosition.
     myLookAt(
-        cameraPosition[0], cameraPosition[1], cameraPosition[2],
-        cameraFocus[0], cameraFocus[1], cameraFocus[2],
+        state.cameraPosition[0], state.cameraPosition[1], state.cameraPosition[2],
+        state.cameraFocus[0], state.cameraFocus[1], state.cameraFocus[2],
         0, 2, 0
     );
 
-    // Ask the scene to display itself.
-    scenarios[currentScene]->display();
+    // Light the scene from over the camera's shoulder (given in world space,
+    // now that the camera is set up), if asked to.
+    if (state.lighting) {
+        Vector light = state.cameraPosition - state.cameraFocus + Vector(1, 2, 0);
+        myEnable(GL_LIGHTING);
+        myEnable(GL_LIGHT0);
+        myEnable(GL_COLOR_MATERIAL);
+        myLight(GL_LIGHT0, GL_POSITION, light[0], light[1], light[2], 0);
+        myMaterial(GL_SPECULAR, 0.6, 0.6, 0.6, 1);
+        myMaterial(GL_SHININESS, 32, 0, 0, 0);
+    } else {
+        myDisable(GL_LIGHTING);
+    }
+
+    // Ask the scene to display itself. Static scenes are recorded the first
+    // time, and replayed from their display list after that. Either way its
+    // draws are queued, and sorted to switch textures as little as possible.
+    myBeginQueue(state.queueMode);
+    Scenario const *scene = scenarios[state.scene];
+    if (scene->isStatic()) {
+        int &list = sceneLists[state.scene];
+        if (!list) {
+            list = myGenList();
+            myNewList(list);
+            scene->display();
+            myEndList();
+        }
+        myCallList(list);
+    } else {
+        scene->display();
+    }
+    myFlushQueue();
+    myResolve();
+
+    frameStats[buffer] = myGetStats();
+    frameTimes[buffer] = now() - start;
+    if (reportFrameTimes) {
+        fprintf(stderr, "frame: scene %.2fms\n", frameTimes[buffer]);
+    }
+}
+
+
+// The render thread's main loop: waits for input to change, then draws a new
+// frame into a color buffer that is neither shown nor waiting to be shown.
+static void renderLoop() {
+
+    traceThreadName("render");
+    std::unique_lock<std::mutex> lock(frameMutex);
+
+    while (true) {
+
+        while (!frameRequested && !quitting) {
+            frameRequestedSignal.wait(lock);
+        }
+        if (quitting) {
+            return;
+        }
+        frameRequested = false;
+
+        // Sample the input now, as late as possible. If nothing that affects
+        // the scene has changed (e.g. only the grid was toggled) then the
+        // frame already shown is still good.
+        FrameState state = requested;
+        unsigned long long hash = frameHash(state);
+        if (hash == lastFrameHash && scenarios[state.scene]->isStatic()) {
+            continue;
+        }
+        lastFrameHash = hash;
+
+        int buffer = 0;
+        while (buffer == presentedBuffer || buffer == readyBuffer) {
+            buffer++;
+        }
+
+        rendering = true;
+        lock.unlock();
+        drawFrame(state, buffer);
+        lock.lock();
+        rendering = false;
+
+        // If an earlier frame was never shown, this one replaces it.
+        readyBuffer = buffer;
+    }
+}
+
+
+// Draws the grid overlay (if visible), returning how long it took.
+static double drawGrid() {
+    if (!gridIsVisible) {
+        return 0;
+    }
+    double start = now();
+    drawPixelGrid();
+    // Wait for OpenGL to actually draw it, so the time is meaningful.
+    if (reportFrameTimes) {
+        glFinish();
+    }
+    return now() - start;
+}
+
+
+// How many times each covered pixel was shaded.
+static double overdraw(MyStats const &stats) {
+    return stats.pixelsCovered ? double(stats.fragmentsShaded) / stats.pixelsCovered : 0;
+}
+
+
+// Writes out pipeline statistics as a single line of JSON.
+static void printStats(FILE *file, char const *scene, int queueMode, bool multisampled,
+                       MyStats const &stats, double frameTime) {
+    fprintf(file, "{\"scene\": \"%s\", \"queue\": \"%s\", \"multisampled\": %s, \"frameTime\": %.3f, "
+        "\"verticesSubmitted\": %ld, \"verticesTransformed\": %ld, "
+        "\"primitivesCulled\": %ld, \"primitivesClipped\": %ld, "
+        "\"fragmentsGenerated\": %ld, \"depthPasses\": %ld, \"depthFails\": %ld, "
+        "\"fragmentsShaded\": %ld, \"pixelsCovered\": %ld, \"overdraw\": %.3f, "
+        "\"textureSamples\": %ld, \"instancesCulled\": %ld, "
+        "\"transformTime\": %.3f, \"rasterTime\": %.3f}\n",
+        scene, queueModeNames[queueMode], multisampled ? "true" : "false", frameTime,
+        stats.verticesSubmitted, stats.verticesTransformed,
+        stats.primitivesCulled, stats.primitivesClipped,
+        stats.fragmentsGenerated, stats.depthPasses, stats.depthFails,
+        stats.fragmentsShaded, stats.pixelsCovered, overdraw(stats),
+        stats.textureSamples, stats.instancesCulled,
+        stats.transformTime, stats.rasterTime
+    );
+}
+
+
+// Draws the pipeline statistics for a frame in the corner of the window.
+static void drawStats(MyStats const &stats, double frameTime) {
+
+    char lines[9][64];
+    snprintf(lines[0], 64, "frame      %8.2f ms", frameTime);
+    snprintf(lines[1], 64, "transform  %8.2f ms", stats.transformTime);
+    snprintf(lines[2], 64, "raster     %8.2f ms", stats.rasterTime);
+    snprintf(lines[3], 64, "vertices   %8ld / %ld", stats.verticesTransformed, stats.verticesSubmitted);
+    snprintf(lines[4], 64, "culled     %8ld", stats.primitivesCulled);
+    snprintf(lines[5], 64, "clipped    %8ld", stats.primitivesClipped);
+    snprintf(lines[6], 64, "fragments  %8ld (%ld pass, %ld fail)", stats.fragmentsGenerated, stats.depthPasses, stats.depthFails);
+    snprintf(lines[7], 64, "shaded     %8ld (%.2fx overdraw)", stats.fragmentsShaded, overdraw(stats));
+    snprintf(lines[8], 64, "texels     %8ld", stats.textureSamples);
+
+    // Lay text out in real pixels, from the top left corner.
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, realWidth, 0, realHeight, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+    glDisable(GL_DEPTH_TEST);
+
+    glColor3d(1, 1, 0);
+    for (int i = 0; i < 9; i++) {
+        glRasterPos2i(6, realHeight - 16 - 14 * i);
+        for (char const *c = lines[i]; *c; c++) {
+            glutBitmapCharacter(GLUT_BITMAP_8_BY_13, *c);
+        }
+    }
+
+    glPopAttrib();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+}
+
+
+// Called by GLUT when we need to redraw the screen. This only shows the
+// latest frame finished by the render thread (or the one shown before, if
+// there isn't a new one), so it is cheap when the window is merely exposed.
+static void display(void) {
+
+    TRACE_SCOPE("display");
+    double start = now();
+
+    int buffer;
+    {
+        std::lock_guard<std::mutex> lock(frameMutex);
+        if (readyBuffer >= 0) {
+            presentedBuffer = readyBuffer;
+            readyBuffer = -1;
+        }
+        buffer = presentedBuffer;
+    }
+
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    if (buffer >= 0) {
+        myPresent(buffer);
+    }
+
+    // The grid is an overlay on top of the scene, so it is not part of the
+    // frames the render thread draws.
+    double gridTime = drawGrid();
+
+    if (statsAreVisible && buffer >= 0) {
+        drawStats(frameStats[buffer], frameTimes[buffer]);
+    }
 
     // Transfer whatever we have drawn to the screen.
     glutSwapBuffers();
+
+    if (reportFrameTimes) {
+        fprintf(stderr, "present: grid %.2fms, total %.2fms\n",
+            gridTime, now() - start);
+    }
+
+    // Keep the per-thread trace buffers from filling up.
+    if (traceIsEnabled()) {
+        traceCollect();
+    }
+}
+
+
+// Writes out the trace, if one is being recorded, on the way out of exit().
+static void writeTraceAtExit() {
+    if (traceIsEnabled()) {
+        traceWrite(traceFilename);
+        fprintf(stderr, "trace written to %s\n", traceFilename);
+    }
+}
+
+
+// Opens a file given on the command line: a scene description becomes an
+// extra scene, and anything else is the OBJ file shown in scene H. Returns
+// the index of the scene showing it, or -1 if it could not be read.
+static int openFile(char const *filename) {
+    if (!isSceneFile(filename)) {
+        objFilename = filename;
+        return 'h' - 'a';
+    }
+    Scenario *scenario = loadSceneFile(filename);
+    if (!scenario) {
+        return -1;
+    }
+    scenarios.push_back(scenario);
+    sceneLists.resize(scenarios.size(), 0);
+    return scenarios.size() - 1;
+}
+
+
+// Draws every scene once in each queue mode without opening a window, and
+// prints the pipeline statistics of each as a line of JSON.
+static int runBatch(char const *filename) {
+
+    initScenarios();
+    sceneLists.resize(scenarios.size(), 0);
+    if (filename) {
+        openFile(filename);
+    }
+
+    for (int i = 0; i < scenarios.size(); i++) {
+        for (int mode = 0; mode < queueModeCount * 2; mode++) {
+            FrameState state;
+            scenarios[i]->init(state.cameraPosition, state.cameraFocus, state.usePerspective);
+            state.perspectiveCorrectTextures = perspectiveCorrectTextures;
+            state.perspectiveSpanLength = perspectiveSpanLength;
+            state.drawAsPoints = drawAsPoints;
+            state.multisampling = mode >= queueModeCount;
+            state.lighting = false;
+            state.queueMode = mode % queueModeCount;
+            state.scene = i;
+            state.virtualWidth = realWidth / virtualPixelSize;
+            state.virtualHeight = realHeight / virtualPixelSize;
+            drawFrame(state, 0);
+
+            char name[2] = {char('a' + i), 0};
+            printStats(stdout, name, state.queueMode, state.multisampling, frameStats[0], frameTimes[0]);
+        }
+    }
+
+    return 0;
 }
 
 
 int main(int argc, char **argv) {
 
+    // "--batch [OBJ or SCENE]" skips the window entirely.
+    if (argc > 1 && !strcmp(argv[1], "--batch")) {
+        return runBatch(argc > 2 ? argv[2] : NULL);
+    }
+
+    // "--pack OBJ PACK" converts an OBJ into a cluster pack, and exits.
+    if (argc > 1 && !strcmp(argv[1], "--pack")) {
+        if (argc != 4) {
+            std::cerr << "usage: " << argv[0] << " --pack OBJ PACK" << std::endl;
+            return 1;
+        }
+        return packOBJ(argv[2], argv[3]) ? 0 : 1;
+    }
+
+    // "--check" runs the self-checks, and fails if any of them do.
+    if (argc > 1 && !strcmp(argv[1], "--check")) {
+        return runChecks() ? 1 : 0;
+    }
+
     // Initialize GLUT and open a window.
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
@@ -269,14 +766,28 @@ int main(int argc, char **argv) {
 
     // Setup the scenarios and pick the first one (by simulating a keystroke).
     initScenarios();
+    sceneLists.resize(scenarios.size(), 0);
     keyboard('a', 0, 0);
 
-    // Save the name of the OBJ file to display, and jump to that scene.
+    // Open the OBJ or scene file to display, and jump to its scene.
     if (argc > 1) {
-        objFilename = argv[1];
-        keyboard('h', 0, 0);
+        int scene = openFile(argv[1]);
+        if (scene >= 0) {
+            keyboard('a' + scene, 0, 0);
+        }
     }
 
+    // Start drawing frames; the thread is stopped on the way out of exit(),
+    // before any trace is written.
+    requested.perspectiveCorrectTextures = perspectiveCorrectTextures;
+    requested.perspectiveSpanLength = perspectiveSpanLength;
+    requested.drawAsPoints = drawAsPoints;
+    requested.multisampling = multisampling;
+    traceThreadName("glut");
+    atexit(writeTraceAtExit);
+    renderThread = std::thread(renderLoop);
+    atexit(stopRenderThread);
+
     // Pass control to GLUT.
     glutMainLoop();
     return 0;
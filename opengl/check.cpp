@@ -0,0 +1,171 @@
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#ifdef __APPLE__
+#  include <GLUT/glut.h>
+#else
+#  include <GL/glut.h>
+#endif
+
+#include "check.hpp"
+#include "linalg.hpp"
+#include "mygl.hpp"
+#include "object.hpp"
+#include "scenegraph.hpp"
+
+
+// Is every coordinate of a within a small distance of b's?
+static bool near(Vector const &a, Vector const &b) {
+    for (int i = 0; i < 3; i++) {
+        if (fabs(a[i] - b[i]) > 1e-9) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Sets up a small virtual window, cleared, with identity matrices.
+static void startFrame(int size) {
+    myViewport(size, size);
+    myDrawBuffer(0);
+    myClear();
+    myLoadIdentity();
+}
+
+
+// A node's world bounds are its Object's box taken through its transform,
+// and its parents', and move when any of them do.
+static bool checkSceneBounds() {
+
+    Object const &cube = Object::fromFile("cube.obj");
+    if (!cube.good()) {
+        std::cerr << "  cube.obj could not be loaded" << std::endl;
+        return false;
+    }
+    Vector offset(100, 5, 0);
+
+    SceneNode root;
+    SceneNode &group = root.addChild();
+    SceneNode &node = group.addChild();
+    node.setObject(&cube);
+    group.setTransform(Matrix(
+        1, 0, 0, offset[0],
+        0, 1, 0, 0,
+        0, 0, 1, 0,
+        0, 0, 0, 1
+    ));
+    node.setTransform(Matrix(
+        1, 0, 0, 0,
+        0, 1, 0, offset[1],
+        0, 0, 1, 0,
+        0, 0, 0, 1
+    ));
+    startFrame(16);
+    root.draw();
+    bool ok = near(node.worldMin(), cube.min() + offset) && near(node.worldMax(), cube.max() + offset) &&
+              near(root.worldMin(), cube.min() + offset) && near(root.worldMax(), cube.max() + offset);
+
+    // Moving a parent moves everything below it.
+    group.setTransform(Matrix::identity());
+    offset[0] = 0;
+    root.draw();
+    ok = ok && near(node.worldMin(), cube.min() + offset) && near(node.worldMax(), cube.max() + offset) &&
+               near(root.worldMin(), cube.min() + offset) && near(root.worldMax(), cube.max() + offset);
+
+    if (!ok) {
+        std::cerr << "  translated node bounds x [" << node.worldMin()[0] << ", " << node.worldMax()[0]
+                  << "], y [" << node.worldMin()[1] << ", " << node.worldMax()[1] << "]" << std::endl;
+    }
+    return ok;
+}
+
+
+// Convex polygons, in pixels, for checkPolygonMatchesFan(): the polygon of
+// scenario I, a quad with its corners between pixel centers, one with its
+// edges through pixel centers, and a sliver.
+static int const fanPolygonCount = 4;
+static int const fanPolygonSizes[fanPolygonCount] = {5, 4, 4, 6};
+static double const fanPolygons[fanPolygonCount][6][2] = {
+    {{15.5, 31.5}, {23.5, 39.5}, {39.5, 39.5}, {47.5, 31.5}, {31.5, 7.5}},
+    {{3.3, 5.7}, {50.1, 10.2}, {58.6, 49.9}, {9.4, 40.05}},
+    {{10, 10}, {40, 20}, {50, 50}, {20, 40}},
+    {{2, 30}, {20, 30.5}, {40, 31.5}, {61, 34}, {40, 33}, {20, 32}},
+};
+
+
+// Gives a vertex at a point in pixels of a window of the given size (with
+// identity matrices).
+static void pixelVertex(double const *point, int size) {
+    myVertex((point[0] + 0.5) * 2 / size - 1, (point[1] + 0.5) * 2 / size - 1, 0);
+}
+
+
+// Draws a convex polygon, given in pixels, into a cleared window of the given
+// size, as one primitive or as a fan of triangles, and reads it back.
+static std::vector<unsigned char> drawPolygon(double const (*corners)[2], int n, bool fan, int size) {
+    startFrame(size);
+    myColor(1, 1, 1);
+    if (fan) {
+        myBegin(GL_TRIANGLES);
+        for (int i = 2; i < n; i++) {
+            pixelVertex(corners[0], size);
+            pixelVertex(corners[i - 1], size);
+            pixelVertex(corners[i], size);
+        }
+    } else {
+        myBegin(n == 4 ? GL_QUADS : GL_POLYGON);
+        for (int i = 0; i < n; i++) {
+            pixelVertex(corners[i], size);
+        }
+    }
+    myEnd();
+    std::vector<unsigned char> pixels(4 * size * size);
+    myReadPixels(0, &pixels[0]);
+    return pixels;
+}
+
+
+// A polygon covers exactly the pixels a fan of triangles covering it does,
+// as multisampling and the visibility buffer draw polygons as fans.
+static bool checkPolygonMatchesFan() {
+    int const size = 64;
+    bool ok = true;
+    for (int i = 0; i < fanPolygonCount; i++) {
+        std::vector<unsigned char> polygon = drawPolygon(fanPolygons[i], fanPolygonSizes[i], false, size);
+        std::vector<unsigned char> fan = drawPolygon(fanPolygons[i], fanPolygonSizes[i], true, size);
+        int covered = 0, differing = 0;
+        for (int p = 0; p < size * size; p++) {
+            covered += polygon[4 * p] != 0;
+            differing += polygon[4 * p] != fan[4 * p];
+        }
+        if (!covered || differing) {
+            std::cerr << "  polygon " << i << " covers " << covered << " pixels, and its fan differs at "
+                      << differing << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+
+// Every check, by name.
+static struct {
+    char const *name;
+    bool (*run)();
+} const checks[] = {
+    {"scene graph bounds", checkSceneBounds},
+    {"polygons match fans", checkPolygonMatchesFan},
+};
+
+
+int runChecks() {
+    int failed = 0;
+    for (int i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        bool ok = checks[i].run();
+        std::cerr << (ok ? "ok     " : "FAILED ") << checks[i].name << std::endl;
+        failed += !ok;
+    }
+    return failed;
+}
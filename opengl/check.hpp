@@ -0,0 +1,14 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+
+// Self-checks that need no window, run by "a3 --check" (or "make check").
+// Each builds or draws something small, and compares the result with what it
+// should be.
+
+
+// Runs every check, reporting each that fails. Returns how many failed.
+int runChecks();
+
+
+#endif
@@ -1,8 +1,11 @@
+#include <algorithm>
 #include <cstdio>
 #include <iostream>
 #include <fstream>
 
 #include "image.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
 
 
 // Initialization of the cache map.
@@ -11,6 +14,8 @@ std::map<std::string,Image> Image::cache_;
 
 bool Image::readPPM(std::string const &filename) {
 
+    TRACE_SCOPE("Image::readPPM");
+
     // Open and assert the file is good.
     std::ifstream file(filename.c_str());
     if (!file.good()) {
@@ -66,6 +71,29 @@ Image& Image::fromFile(std::string const &filename) {
 }
 
 
+void Image::preload(std::vector<std::string> const &filenames) {
+
+    TRACE_SCOPE("Image::preload");
+
+    // Find what is not loaded yet; only this thread touches the cache.
+    std::vector<std::string> names;
+    std::vector<Image*> images;
+    for (int i = 0; i < filenames.size(); i++) {
+        Image &image = Image::cache_[filenames[i]];
+        if (!image.good() && std::find(images.begin(), images.end(), &image) == images.end()) {
+            names.push_back(filenames[i]);
+            images.push_back(&image);
+        }
+    }
+
+    parallelFor(images.size(), 1, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            images[i]->readPPM(names[i]);
+        }
+    });
+}
+
+
 Vector Image::lookup(double u, double v) const {
 
     // Clamp coords from 0 to 1.
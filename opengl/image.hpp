@@ -4,6 +4,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include "linalg.hpp"
 
@@ -36,6 +37,10 @@ public:
     // found or the file was corrupt.
     static Image& fromFile(std::string const &filename);
 
+    // Loads all of the given files that are not in the cache yet, several at
+    // once, so that fromFile() finds them there.
+    static void preload(std::vector<std::string> const &filenames);
+
     // Tell us if the Image is ready to be used.
     bool good() const { return data_ != NULL; }
 
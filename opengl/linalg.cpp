@@ -214,6 +214,50 @@ Matrix Matrix::transpose() const {
 }
 
 
+Matrix Matrix::inverse() const {
+
+    // Gauss-Jordan elimination with partial pivoting, performed on a copy of
+    // this matrix while the same operations turn the identity into the
+    // inverse.
+    Matrix a(*this);
+    Matrix result = Matrix::identity();
+
+    for (int c = 0; c < 4; c++) {
+
+        // Find the row with the largest value in this column.
+        int pivot = c;
+        for (int r = c + 1; r < 4; r++) {
+            if (fabs(a[r][c]) > fabs(a[pivot][c])) {
+                pivot = r;
+            }
+        }
+        if (a[pivot][c] == 0) {
+            return Matrix(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        }
+
+        // Swap it into place, and scale it so the pivot is 1.
+        Vector tmp = a[c]; a[c] = a[pivot]; a[pivot] = tmp;
+        tmp = result[c]; result[c] = result[pivot]; result[pivot] = tmp;
+        double scale = 1.0 / a[c][c];
+        a[c] = a[c] * scale;
+        result[c] = result[c] * scale;
+
+        // Eliminate this column from every other row.
+        for (int r = 0; r < 4; r++) {
+            if (r != c && a[r][c] != 0) {
+                double factor = a[r][c];
+                for (int i = 0; i < 4; i++) {
+                    a[r][i] -= factor * a[c][i];
+                    result[r][i] -= factor * result[c][i];
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+
 Vector Matrix::operator*(Vector const &other) const {
     return Vector(
         other.dot(data_[0], true),
@@ -107,6 +107,10 @@ public:
     // Return a transposed copy of the matrix.
     Matrix transpose() const;
 
+    // Return the inverse of the matrix, or the zero matrix if it is
+    // singular.
+    Matrix inverse() const;
+
     // Multiplication of a column Vector by the matrix.
     // E.g.: `Vector b = m * a` where m is a Matrix and a is a Vector.
     Vector operator*(Vector const &other) const;
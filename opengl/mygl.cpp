@@ -4,10 +4,23 @@
 ////////////////////////////////////////////////////////////.
 
 
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
+#include <cstring>
 #include <cfloat>
 #include <iostream>
 #include <cmath>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+
+// We want the prototypes for pixel buffer objects, where the platform's GL
+// headers have them.
+#define GL_GLEXT_PROTOTYPES
 
 #ifdef __APPLE__
 #  include <GLUT/glut.h>
@@ -15,14 +28,24 @@
 #  include <GL/glut.h>
 #endif
 
+// Pixel buffer objects can be linked against directly everywhere but
+// Windows, whose GL library stops at 1.1.
+#if defined(GL_PIXEL_UNPACK_BUFFER) && !defined(_WIN32)
+#  define MYGL_PIXEL_BUFFERS
+#endif
+
 #include "image.hpp"
 #include "mygl.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
 
 
 // Flags that are defined/set in a3.cpp.
 extern bool perspectiveCorrectTextures;
-extern bool gridIsVisible;
+extern int perspectiveSpanLength;
 extern bool drawAsPoints;
+extern bool usePixelBuffers;
+extern bool multisampling;
 
 // The dimensions of the virtual window we are drawing into.
 int virtualWidth;
@@ -32,11 +55,117 @@ int virtualHeight;
 Matrix projectionMatrix;
 Matrix modelViewMatrix;
 
+// How deep myPushMatrix() can go, as in OpenGL.
+static int const maxStackDepth = 32;
+
+// Model-view matrices saved by myPushMatrix().
+static Matrix modelViewStack[maxStackDepth];
+static int modelViewStackDepth = 0;
+
+// Matrices derived from the two above, which are only recomputed when the
+// matrices they depend on have changed: projection * model-view, the
+// inverse-transpose of the model-view (which transforms normals), and whether
+// the projection is a perspective one.
+static Matrix modelViewProjectionMatrix;
+static Matrix normalMatrix;
+static bool modelViewProjectionIsDirty = true;
+static bool normalMatrixIsDirty = true;
+static bool projectionIsPerspective = false;
+
 // Current color, texture, and texture coordinates.
 Vector currentColor;
 Image *currentTexture;
 double currentTextureCoord[2];
-Vector currentNormal;
+Vector currentNormal(0, 0, 1);
+
+// How many lights there are (GL_LIGHT0 onwards).
+static int const maxLights = 8;
+
+// A light's colors, and its position in eye space (a direction towards the
+// light when w is 0).
+struct Light {
+    bool enabled;
+    double position[4];
+    double ambient[3], diffuse[3], specular[3];
+};
+
+// Lighting state, with OpenGL's defaults: only GL_LIGHT0 has any diffuse or
+// specular color, and everything starts off.
+static Light lights[maxLights];
+static bool lightingEnabled = false;
+static bool colorMaterialEnabled = false;
+static double const sceneAmbient[3] = {0.2, 0.2, 0.2};
+static struct {
+    double ambient[3], diffuse[3], specular[3], emission[3];
+    double shininess;
+} material = {
+    {0.2, 0.2, 0.2}, {0.8, 0.8, 0.8}, {0, 0, 0}, {0, 0, 0}, 0
+};
+
+static bool setUpLights() {
+    for (int i = 0; i < maxLights; i++) {
+        Light &light = lights[i];
+        light.enabled = false;
+        double brightness = i ? 0 : 1;
+        for (int j = 0; j < 3; j++) {
+            light.ambient[j] = 0;
+            light.diffuse[j] = light.specular[j] = brightness;
+            light.position[j] = j == 2;
+        }
+        light.position[3] = 0;
+    }
+    return true;
+}
+static bool lightsAreSetUp = setUpLights();
+
+
+// The primitive type given to myBegin().
+int currentPrimitive;
+
+
+// A vertex as it travels down the pipeline. The position starts out in object
+// coordinates, is transformed into clip coordinates by myEnd(), and once the
+// primitive has been clipped it is projected into virtual window coordinates,
+// with a depth in z and 1/w in w (for perspective correct interpolation).
+struct PipelineVertex {
+    Vector position;
+    Vector normal;
+    Vector color;
+    double texCoord[2];
+};
+
+// All of the vertices given since the last myBegin().
+std::vector<PipelineVertex> vertexBatch;
+
+// Draws still waiting for myFlushQueue(), if draws are being queued: each
+// batch's vertices (in clip coordinates) are kept in one array, along with
+// everything about its raster state.
+struct QueuedBatch {
+    int first, count;
+    int primitive;
+    Image *texture;
+    int features;
+    double depth;
+    int depthBucket;
+};
+static bool queueingDraws = false;
+static int queueMode = MYGL_QUEUE_STATE_SORTED;
+static std::vector<QueuedBatch> drawQueue;
+static std::vector<PipelineVertex> queuedVertices;
+
+// How finely queued batches are sorted by depth.
+static int const depthBuckets = 16;
+
+// Counters for the work done since the last myClear().
+static MyStats stats;
+
+
+// Milliseconds since an arbitrary fixed point in time.
+static double now() {
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
 
 
 // A class to simplify lookup of two-dimensional zBuffer data from an array
@@ -71,6 +200,15 @@ public:
         }
     }
 
+    // Count the depth values written since the last clear.
+    int covered() const {
+        int count = 0;
+        for (int i = 0; i < size_; i++) {
+            count += data_[i] != DBL_MAX;
+        }
+        return count;
+    }
+
     // Get a pointer to the given row of depth data, which can be indexed
     // again to get/set depth values.
     // E.g.: `zBuffer[x][y] = newDepthValue`.
@@ -81,6 +219,129 @@ public:
 } zBuffer;
 
 
+// How many samples each pixel has when multisampling, and where they are
+// relative to its center: a rotated grid, so that edges near horizontal or
+// vertical still cover one, two, three or four of them.
+static int const samplesPerPixel = 4;
+static int const allSamples = (1 << samplesPerPixel) - 1;
+static double const sampleOffsets[samplesPerPixel][2] = {
+    {-0.125, -0.375}, {0.375, -0.125}, {-0.375, 0.125}, {0.125, 0.375}
+};
+
+// How far from a pixel's center its samples reach, along either axis.
+static double const sampleReach = 0.375;
+
+
+// The depth and RGB color of every sample of a virtual window's worth of
+// pixels, for multisampling. Drawing goes here rather than into the depth and
+// color buffers, and myResolve() averages each pixel's samples into the
+// color buffer.
+class SampleBuffer {
+private:
+
+    int width_, height_;
+    std::vector<double> depth_;
+    std::vector<unsigned char> color_;
+
+public:
+
+    SampleBuffer() : width_(0), height_(0) {}
+
+    // Reshape the buffer to the given size, and clear every sample to black
+    // and as far away as possible.
+    void clear(int w, int h) {
+        width_ = w;
+        height_ = h;
+        depth_.assign(samplesPerPixel * w * h, DBL_MAX);
+        color_.assign(3 * samplesPerPixel * w * h, 0);
+    }
+
+    // Count the pixels with any sample written since the last clear.
+    int covered() const {
+        int count = 0;
+        for (int i = 0; i < depth_.size(); i += samplesPerPixel) {
+            for (int s = 0; s < samplesPerPixel; s++) {
+                if (depth_[i + s] != DBL_MAX) {
+                    count++;
+                    break;
+                }
+            }
+        }
+        return count;
+    }
+
+    // Get pointers to the depths, and RGB bytes, of the given pixel's samples.
+    double* depth(int x, int y) {
+        return &depth_[samplesPerPixel * (y * width_ + x)];
+    }
+    unsigned char* color(int x, int y) {
+        return &color_[3 * samplesPerPixel * (y * width_ + x)];
+    }
+
+} sampleBuffer;
+
+
+// A virtual window's worth of pixels, which myPresent() uploads to a texture
+// to show them. Rows are stored bottom to top as RGBA bytes, which is what
+// glTexSubImage2D expects.
+class ColorBuffer {
+private:
+
+    int width_, height_, allocated_;
+    unsigned char *data_;
+
+    // Bumped every time the buffer is cleared for a new frame, so that
+    // myPresent() can tell whether it has already uploaded this one.
+    unsigned generation_;
+
+public:
+
+    ColorBuffer() : width_(0), height_(0), allocated_(0), data_(NULL), generation_(0) {}
+
+    // Reshape the buffer to the given size, and set every pixel to opaque
+    // black for a new frame.
+    void clear(int w, int h) {
+        width_ = w;
+        height_ = h;
+        if (size() > allocated_) {
+            delete [] data_;
+            allocated_ = size();
+            data_ = new unsigned char[allocated_];
+        }
+        for (int i = 0; i < size(); i += 4) {
+            data_[i] = data_[i + 1] = data_[i + 2] = 0;
+            data_[i + 3] = 255;
+        }
+        generation_++;
+    }
+
+    // Get a pointer to the RGBA bytes of the given pixel.
+    unsigned char* pixel(int x, int y) {
+        return data_ + 4 * (y * width_ + x);
+    }
+
+    unsigned char const* data() const { return data_; }
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int size() const { return 4 * width_ * height_; }
+    unsigned generation() const { return generation_; }
+
+};
+
+
+// The color buffers that can be drawn into, and the one currently being drawn
+// into. While one is being shown, the next frame can be drawn into another
+// (on another thread, even), as nothing else is shared between the two.
+static ColorBuffer colorBuffers[MYGL_COLOR_BUFFERS];
+static ColorBuffer *drawBuffer = &colorBuffers[0];
+
+
+// Converts a color channel from 0 to 1 into a byte, as it is stored.
+static inline unsigned char colorByte(double c) {
+    return (unsigned char)(std::min(1.0, std::max(0.0, c)) * 255 + 0.5);
+}
+
+
 // A function to set a pixel value on the screen. This is the entry point that
 // you MUST use to draw to the screen.
 void setPixel(int x, int y, double r, double g, double b)
@@ -89,34 +350,230 @@ void setPixel(int x, int y, double r, double g, double b)
         std::cerr << "attempting to set a pixel that is off-screen;" << x << ", " << y << std::endl;
         return;
     }
-    glColor3d(r, g, b);
-    glBegin(GL_POINTS);
-    glVertex2i(x, y);
-    glEnd();
+    unsigned char *p = drawBuffer->pixel(x, y);
+    p[0] = colorByte(r);
+    p[1] = colorByte(g);
+    p[2] = colorByte(b);
+}
+
+
+// Everything below up to myLoadIdentity() is about showing color buffers,
+// and so must only be called from the thread owning the OpenGL context.
+
+// The size of the color buffer last shown; the grid and the present quad are
+// laid out in its virtual pixels.
+static int presentWidth = 0;
+static int presentHeight = 0;
+
+
+// Sets up OpenGL's matrices to map the shown color buffer's virtual pixels
+// onto the whole real viewport. Undo with popPresentMatrices().
+static void pushPresentMatrices() {
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(-0.5, presentWidth - 0.5, -0.5, presentHeight - 0.5, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+}
+
+
+static void popPresentMatrices() {
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+}
+
+
+// Line endpoints for the virtual pixel grid, as x,y,z triples, and the size
+// they were built for. They only depend on the size of the virtual window,
+// so they are only rebuilt when that changes, and drawn with a single call.
+static std::vector<float> gridVertices;
+static int gridWidth = -1;
+static int gridHeight = -1;
+
+
+// Rebuilds the pixel grid's line endpoints for the shown color buffer.
+static void buildPixelGrid() {
+
+    gridWidth = presentWidth;
+    gridHeight = presentHeight;
+    gridVertices.clear();
+    gridVertices.reserve(6 * (gridWidth + gridHeight + 2));
+
+    // Vertical grid lines.
+    for (float x = -0.5; x <= gridWidth; x++) {
+        float line[6] = {x, -0.5f, 1.0f, x, gridHeight + 0.5f, 1.0f};
+        gridVertices.insert(gridVertices.end(), line, line + 6);
+    }
+
+    // Horizontal grid lines.
+    for (float y = -0.5; y <= gridHeight; y++) {
+        float line[6] = {-0.5f, y, 1.0f, gridWidth + 0.5f, y, 1.0f};
+        gridVertices.insert(gridVertices.end(), line, line + 6);
+    }
 }
 
 
 // Draws the virtual pixel grid.
 void drawPixelGrid() {
 
+    if (gridWidth != presentWidth || gridHeight != presentHeight) {
+        buildPixelGrid();
+    }
+    if (gridVertices.empty()) {
+        return;
+    }
+
     // Dark gray.
     glColor4d(0.15, 0.15, 0.15, 1.0);
 
-    // Draw vertical grid lines.
-    for (float x = -0.5; x <= virtualWidth; x++) {
-        glBegin(GL_LINES);
-        glVertex3f(x, -0.5, 1.0);
-        glVertex3f(x, virtualHeight + 0.5, 1.0);
-        glEnd();
+    pushPresentMatrices();
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, &gridVertices[0]);
+    glDrawArrays(GL_LINES, 0, gridVertices.size() / 3);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    popPresentMatrices();
+}
+
+
+// The texture that color buffers are shown through, and the size it was
+// allocated at (a power of two at least as big as the virtual window, as
+// OpenGL 1.1 requires).
+static GLuint presentTexture = 0;
+static int presentTextureWidth = 0;
+static int presentTextureHeight = 0;
+
+// Which color buffer, and which frame drawn into it, the texture holds.
+static ColorBuffer const *uploadedBuffer = NULL;
+static unsigned uploadedGeneration = 0;
+
+#ifdef MYGL_PIXEL_BUFFERS
+// Two pixel buffer objects that uploads alternate between, so that filling
+// one never waits on the transfer out of the other.
+static GLuint pixelBuffers[2] = {0, 0};
+static int nextPixelBuffer = 0;
+#endif
+
+
+// Does this OpenGL implementation support pixel buffer objects?
+static bool pixelBuffersSupported() {
+#ifdef MYGL_PIXEL_BUFFERS
+    static int supported = -1;
+    if (supported < 0) {
+        char const *version = (char const*)glGetString(GL_VERSION);
+        char const *extensions = (char const*)glGetString(GL_EXTENSIONS);
+        supported = (version && atof(version) >= 2.1) ||
+            (extensions && strstr(extensions, "GL_ARB_pixel_buffer_object"));
+        if (supported) {
+            glGenBuffers(2, pixelBuffers);
+        }
+    }
+    return supported;
+#else
+    return false;
+#endif
+}
+
+
+// Uploads a color buffer into the present texture.
+static void uploadColorBuffer(ColorBuffer const &buffer) {
+
+    // (Re)allocate the texture if the virtual window has outgrown it.
+    if (buffer.width() > presentTextureWidth || buffer.height() > presentTextureHeight) {
+        presentTextureWidth = presentTextureHeight = 1;
+        while (presentTextureWidth < buffer.width()) {
+            presentTextureWidth *= 2;
+        }
+        while (presentTextureHeight < buffer.height()) {
+            presentTextureHeight *= 2;
+        }
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, presentTextureWidth, presentTextureHeight,
+            0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+#ifdef MYGL_PIXEL_BUFFERS
+    if (usePixelBuffers && pixelBuffersSupported()) {
+        // Orphan the buffer's old storage and copy the frame in; the
+        // texture upload then proceeds asynchronously while we return to
+        // drawing the next frame.
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffers[nextPixelBuffer]);
+        nextPixelBuffer = 1 - nextPixelBuffer;
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, buffer.size(), NULL, GL_STREAM_DRAW);
+        void *mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+        if (mapped) {
+            memcpy(mapped, buffer.data(), buffer.size());
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, buffer.width(), buffer.height(),
+                GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return;
+    }
+#endif
+
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, buffer.width(), buffer.height(),
+        GL_RGBA, GL_UNSIGNED_BYTE, buffer.data());
+}
+
+
+void myPresent(int index) {
+
+    ColorBuffer const &buffer = colorBuffers[index];
+    if (!buffer.size()) {
+        return;
+    }
+    presentWidth = buffer.width();
+    presentHeight = buffer.height();
+
+    if (!presentTexture) {
+        glGenTextures(1, &presentTexture);
+        glBindTexture(GL_TEXTURE_2D, presentTexture);
+        // Nearest neighbour magnification gives us square virtual pixels.
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    } else {
+        glBindTexture(GL_TEXTURE_2D, presentTexture);
     }
 
-    // Draw horizontal grid lines.
-    for (float y = -0.5; y <= virtualHeight; y++) {
-        glBegin(GL_LINES);
-        glVertex3f(-0.5, y, 1.0);
-        glVertex3f(virtualWidth + 0.5, y, 1.0);
-        glEnd();
+    // Only upload frames we haven't already; showing the same frame again
+    // just redraws the quad.
+    if (uploadedBuffer != &buffer || uploadedGeneration != buffer.generation()) {
+        uploadColorBuffer(buffer);
+        uploadedBuffer = &buffer;
+        uploadedGeneration = buffer.generation();
     }
+
+    glPushAttrib(GL_ENABLE_BIT | GL_TEXTURE_BIT | GL_CURRENT_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_TEXTURE_2D);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    pushPresentMatrices();
+
+    // One quad covering the whole virtual window, edge to edge.
+    double s = double(presentWidth) / presentTextureWidth;
+    double t = double(presentHeight) / presentTextureHeight;
+    glBegin(GL_QUADS);
+    glTexCoord2d(0, 0); glVertex2d(-0.5, -0.5);
+    glTexCoord2d(s, 0); glVertex2d(presentWidth - 0.5, -0.5);
+    glTexCoord2d(s, t); glVertex2d(presentWidth - 0.5, presentHeight - 0.5);
+    glTexCoord2d(0, t); glVertex2d(-0.5, presentHeight - 0.5);
+    glEnd();
+
+    popPresentMatrices();
+    glPopAttrib();
+}
+
+
+void myReadPixels(int index, unsigned char *pixels) {
+    ColorBuffer const &buffer = colorBuffers[index];
+    std::copy(buffer.data(), buffer.data() + buffer.size(), pixels);
 }
 
 
@@ -127,84 +584,2781 @@ void myViewport(int w, int h) {
 }
 
 
+void myDrawBuffer(int index) {
+    drawBuffer = &colorBuffers[index];
+}
+
+
 void myClear() {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    if (gridIsVisible) {
-        drawPixelGrid();
-    }
+    drawBuffer->clear(virtualWidth, virtualHeight);
     zBuffer.clear();
+    if (multisampling) {
+        sampleBuffer.clear(virtualWidth, virtualHeight);
+    }
+    drawQueue.clear();
+    queuedVertices.clear();
+    stats = MyStats();
+}
+
+
+MyStats myGetStats() {
+    MyStats result = stats;
+    result.pixelsCovered = multisampling ? sampleBuffer.covered() : zBuffer.covered();
+    return result;
+}
+
+
+void myResolve() {
+    if (!multisampling) {
+        return;
+    }
+    TRACE_SCOPE("myResolve");
+    double start = now();
+
+    // Rows are independent, so are averaged in parallel.
+    parallelForPooled(virtualHeight, 16, [](int chunk, int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            for (int x = 0; x < virtualWidth; x++) {
+                unsigned char const *samples = sampleBuffer.color(x, y);
+                int sum[3] = {0, 0, 0};
+                for (int s = 0; s < samplesPerPixel; s++) {
+                    for (int i = 0; i < 3; i++) {
+                        sum[i] += samples[3 * s + i];
+                    }
+                }
+                setPixel(x, y,
+                         sum[0] / (255.0 * samplesPerPixel),
+                         sum[1] / (255.0 * samplesPerPixel),
+                         sum[2] / (255.0 * samplesPerPixel));
+            }
+        }
+    });
+
+    stats.rasterTime += now() - start;
+}
+
+
+// Flags the matrices derived from the model-view matrix as stale.
+static void modelViewChanged() {
+    modelViewProjectionIsDirty = true;
+    normalMatrixIsDirty = true;
+}
+
+
+// Flags the matrices derived from the projection matrix as stale.
+static void projectionChanged() {
+    modelViewProjectionIsDirty = true;
+    projectionIsPerspective =
+        projectionMatrix[3][0] != 0 || projectionMatrix[3][1] != 0 ||
+        projectionMatrix[3][2] != 0 || projectionMatrix[3][3] != 1;
+}
+
+
+// The projection * model-view matrix, recomputed if either has changed.
+static Matrix const &modelViewProjection() {
+    if (modelViewProjectionIsDirty) {
+        modelViewProjectionMatrix = projectionMatrix * modelViewMatrix;
+        modelViewProjectionIsDirty = false;
+    }
+    return modelViewProjectionMatrix;
+}
+
+
+// The matrix that takes normals into eye space, recomputed if the model-view
+// matrix has changed.
+static Matrix const &normalTransform() {
+    if (normalMatrixIsDirty) {
+        normalMatrix = modelViewMatrix.inverse().transpose();
+        normalMatrixIsDirty = false;
+    }
+    return normalMatrix;
 }
 
 
 void myLoadIdentity() {
     modelViewMatrix = Matrix::identity();
     projectionMatrix = Matrix::identity();
+    modelViewChanged();
+    projectionChanged();
 }
 
 
+// Sets the current texture, or records the change into the display list
+// being recorded.
+static void setTexture(Image *texture);
+
+
+// The last texture looked up by name, so that binding it again skips the
+// lookup.
+static std::string boundTextureName;
+static Image *boundTexture = NULL;
+
+
 void myBindTexture(char const *name) {
-    if (name) {
-        currentTexture = &Image::fromFile(name);
+    if (!name) {
+        setTexture(NULL);
+        return;
+    }
+    if (!boundTexture || boundTextureName != name) {
+        boundTexture = &Image::fromFile(name);
+        boundTextureName = name;
+    }
+    setTexture(boundTexture);
+}
+
+
+// Projects a clipped vertex into virtual window coordinates. The x and y
+// coordinates are such that pixel centers lie on integers, z is a depth where
+// smaller values are closer, and w is replaced with 1/w.
+static void project(PipelineVertex &v) {
+    double invW = 1.0 / v.position[3];
+    double x = v.position[0] * invW;
+    double y = v.position[1] * invW;
+    double z = v.position[2] * invW;
+    // Without myFrustum the projection does not flip z like glOrtho would,
+    // so nearer objects have larger z; flip it so the zBuffer can always
+    // keep the smallest value.
+    if (!projectionIsPerspective) {
+        z = -z;
+    }
+    v.position = Vector(
+        (x + 1.0) * 0.5 * virtualWidth - 0.5,
+        (y + 1.0) * 0.5 * virtualHeight - 0.5,
+        z,
+        invW
+    );
+}
+
+
+// The things a raster pipeline may or may not do for each fragment. Every
+// combination is compiled as its own variant of the raster functions below,
+// and rasterBatch() picks one once per batch, so that e.g. untextured
+// triangles never test anything about textures per pixel. (Depth testing is
+// always on, so it is not one of them.)
+enum RasterFeature {
+    // Colors come from the current texture, rather than the vertices.
+    RASTER_TEXTURED = 1,
+    // Texture coordinates are interpolated perspective correctly.
+    RASTER_PERSPECTIVE = 2,
+    // Vertex colors differ, so must be interpolated; otherwise every
+    // fragment is the first vertex's color.
+    RASTER_SMOOTH = 4,
+    // Perspective correct texture coordinates are only found exactly every
+    // perspectiveSpanLength pixels, and interpolated affinely in between.
+    RASTER_SPANS = 8,
+    // Depth and color go into the sample buffer: triangles find which of
+    // each pixel's samples they cover and depth test each, but are shaded
+    // once per pixel.
+    RASTER_MULTISAMPLE = 16,
+    // Only depth is written (for a depth prepass). This is a variant of its
+    // own, rather than combined with the others (but RASTER_MULTISAMPLE).
+    RASTER_DEPTH_ONLY = 32,
+    // Depth and the ID of the triangle are written into the visibility
+    // buffer, to be shaded later. Also a variant of its own (with or without
+    // RASTER_MULTISAMPLE).
+    RASTER_VISIBILITY = 64
+};
+
+// How many variants the features that combine freely make: every
+// combination of the bits up to and including the highest of them.
+static int const rasterVariants = RASTER_MULTISAMPLE * 2;
+
+
+// A triangle drawn into the visibility buffer: its projected vertices, and
+// what it needs to be shaded.
+struct VisibleTriangle {
+    PipelineVertex a, b, c;
+    Image *texture;
+    int features;
+};
+
+// Every triangle drawn into the visibility buffer since it was cleared, the
+// raster variant the batch being drawn into it would otherwise use, and the
+// ID (index) of the triangle being rasterized.
+static std::vector<VisibleTriangle> visibleTriangles;
+static int visibilityFeatures;
+static int currentTriangleId;
+
+// The ID of the triangle seen at each pixel (row by row), or -1. When
+// multisampling, there is one for each sample of each pixel.
+static std::vector<int> visibilityBuffer;
+
+
+// Tests a fragment's depth against the depth buffer (LEQUAL), and writes it
+// there if it passes. Done before anything else is found for the fragment.
+// When multisampling, each of the covered samples (the bits of coverage) is
+// tested and written instead, at the given depth plus its own offset (if
+// given), and the samples that pass are returned; otherwise the result is
+// whether the fragment passed.
+template <int F>
+static inline int depthTest(int x, int y, double depth,
+                            int coverage = allSamples, double const *offsets = NULL) {
+    stats.fragmentsGenerated++;
+    int passed = 0;
+    if (F & RASTER_MULTISAMPLE) {
+        double *depths = sampleBuffer.depth(x, y);
+        for (int s = 0; s < samplesPerPixel; s++) {
+            double d = offsets ? depth + offsets[s] : depth;
+            if ((coverage >> s & 1) && !(d > depths[s])) {
+                depths[s] = d;
+                passed |= 1 << s;
+            }
+        }
+    } else if (!(depth > zBuffer[x][y])) {
+        zBuffer[x][y] = depth;
+        passed = 1;
+    }
+    if (passed) {
+        stats.depthPasses++;
     } else {
-        currentTexture = NULL;
+        stats.depthFails++;
     }
+    return passed;
 }
 
 
-void myBegin(int type) {
-    // @@@@ YOUR CODE HERE
+// Determines the final color of a fragment that passed the depth test, from
+// its interpolated color and texture coordinates. When multisampling, it is
+// written to the samples that passed (the bits of mask).
+template <int F>
+static inline void writeFragment(int x, int y, Vector const &color, double u, double v, int mask) {
+    if (F & RASTER_DEPTH_ONLY) {
+        return;
+    }
+    if (F & RASTER_VISIBILITY) {
+        if (F & RASTER_MULTISAMPLE) {
+            int *ids = &visibilityBuffer[samplesPerPixel * (y * virtualWidth + x)];
+            for (int s = 0; s < samplesPerPixel; s++) {
+                if (mask >> s & 1) {
+                    ids[s] = currentTriangleId;
+                }
+            }
+        } else {
+            visibilityBuffer[y * virtualWidth + x] = currentTriangleId;
+        }
+        return;
+    }
+    stats.fragmentsShaded++;
+    Vector texel;
+    if (F & RASTER_TEXTURED) {
+        stats.textureSamples++;
+        texel = currentTexture->lookup(u, v);
+    }
+    Vector const &c = F & RASTER_TEXTURED ? texel : color;
+    if (F & RASTER_MULTISAMPLE) {
+        unsigned char rgb[3] = {colorByte(c[0]), colorByte(c[1]), colorByte(c[2])};
+        unsigned char *samples = sampleBuffer.color(x, y);
+        for (int s = 0; s < samplesPerPixel; s++) {
+            if (mask >> s & 1) {
+                std::memcpy(samples + 3 * s, rgb, 3);
+            }
+        }
+    } else {
+        setPixel(x, y, c[0], c[1], c[2]);
+    }
 }
 
 
-void myColor(double r, double g, double b) {
-    // @@@@ YOUR CODE HERE
+// Depth tests a fragment covering the whole pixel, and writes it if it
+// passes.
+template <int F>
+static inline void shadeFragment(int x, int y, double depth, Vector const &color, double u, double v) {
+    if (int mask = depthTest<F>(x, y, depth)) {
+        writeFragment<F>(x, y, color, u, v, mask);
+    }
 }
 
 
-void myVertex(double x, double y, double z) {
-    // @@@@ YOUR CODE HERE
+// Interpolates between two pipeline vertices.
+static PipelineVertex lerpVertex(PipelineVertex const &a, PipelineVertex const &b, double t) {
+    PipelineVertex v;
+    v.position = a.position + (b.position - a.position) * t;
+    v.position[3] = a.position[3] + (b.position[3] - a.position[3]) * t;
+    v.color = a.color + (b.color - a.color) * t;
+    v.texCoord[0] = a.texCoord[0] + (b.texCoord[0] - a.texCoord[0]) * t;
+    v.texCoord[1] = a.texCoord[1] + (b.texCoord[1] - a.texCoord[1]) * t;
+    return v;
 }
 
 
-void myEnd() {
-    // @@@@ YOUR CODE HERE
+// A point ready to be splatted: the pixel it lands in (row by row), its
+// depth, and its color as 0xRRGGBB.
+struct Splat {
+    int pixel;
+    float depth;
+    unsigned color;
+};
+
+// Points are projected this many at a time, a coordinate at a time, in loops
+// the compiler can vectorize.
+static int const splatBlock = 256;
+
+// The nearest point splatted into each pixel since they were last merged
+// into the depth and color buffers, packed with its depth (as bits that
+// order the same way) above its color, so that a single atomic min keeps the
+// nearest one; and how many pixels it holds. Pixels without one hold noSplat.
+// For both to fit in 64 bits, a point's depth is rounded to a float. So
+// points are depth tested against the (double) depth buffer at a float's
+// precision, and may z-fight with coplanar triangles and lines differently
+// than those do with each other.
+static std::unique_ptr<std::atomic<unsigned long long>[]> splatBuffer;
+static int splatBufferSize = 0;
+static unsigned long long const noSplat = ~0ULL;
+
+
+// Maps a depth to bits that, as an unsigned int, order the same way, and back.
+static inline unsigned depthBits(float depth) {
+    unsigned bits;
+    std::memcpy(&bits, &depth, sizeof(bits));
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+static inline float bitsDepth(unsigned bits) {
+    bits = bits & 0x80000000u ? bits & 0x7fffffffu : ~bits;
+    float depth;
+    std::memcpy(&depth, &bits, sizeof(depth));
+    return depth;
 }
 
 
-void myTranslate(double tx, double ty, double tz) {
-    // @@@@ YOUR CODE HERE
+// Packs a color, with channels from 0 to 1, into 0xRRGGBB.
+static inline unsigned packColor(Vector const &color) {
+    return colorByte(color[0]) << 16 | colorByte(color[1]) << 8 | colorByte(color[2]);
 }
 
 
-void myRotate(double angle, double axisX, double axisY, double axisZ) {
-    // @@@@ YOUR CODE HERE
-    // @@@@ NOTE: Make sure you're aware of degrees vs. radians!
+// Draws count points as single pixels, on several threads at once. Calls
+// project(begin, end, splats) for blocks of up to splatBlock points, which
+// fills in splats for those that land in the window and returns how many did.
+// Each is splatted with an atomic min into splatBuffer, so that the nearest
+// point in each pixel (and of those, the lowest color) wins without locks.
+// Then the pixels that were splatted are depth tested and written as
+// fragments (with the color already found), and cleared again.
+template <int F, class Project>
+static void splatPoints(int count, Project const &project) {
+
+    int size = virtualWidth * virtualHeight;
+    if (splatBufferSize != size) {
+        splatBuffer.reset(new std::atomic<unsigned long long>[size]);
+        for (int i = 0; i < size; i++) {
+            splatBuffer[i].store(noSplat, std::memory_order_relaxed);
+        }
+        splatBufferSize = size;
+    }
+
+    // Each pixel is listed by the one thread that splats it first. This runs
+    // for every myDrawPoints(), so the chunks go to the thread pool, and too
+    // few points to fill two of them are splatted on this thread alone.
+    int const grain = 4 * splatBlock;
+    int chunks = parallelChunkCount(count, grain);
+    std::vector<std::vector<int> > splatted(chunks);
+    std::vector<long> landed(chunks, 0);
+
+    parallelForPooled(count, grain, [&](int chunk, int begin, int end) {
+        Splat splats[splatBlock];
+        for (int block = begin; block < end; block += splatBlock) {
+            int n = project(block, std::min(end, block + splatBlock), splats);
+            landed[chunk] += n;
+            for (int i = 0; i < n; i++) {
+                unsigned long long packed = (unsigned long long)depthBits(splats[i].depth) << 32 | splats[i].color;
+                std::atomic<unsigned long long> &pixel = splatBuffer[splats[i].pixel];
+                unsigned long long old = pixel.load(std::memory_order_relaxed);
+                while (packed < old && !pixel.compare_exchange_weak(old, packed, std::memory_order_relaxed)) {
+                }
+                if (packed < old && old == noSplat) {
+                    splatted[chunk].push_back(splats[i].pixel);
+                }
+            }
+        }
+    });
+
+    // Points that did not land in the window were culled, and those beaten
+    // by a nearer point in the same pixel failed their depth test.
+    long total = 0;
+    for (int c = 0; c < chunks; c++) {
+        total += landed[c];
+    }
+    stats.primitivesCulled += count - total;
+    if (F & RASTER_TEXTURED) {
+        stats.textureSamples += total;
+    }
+
+    for (int c = 0; c < chunks; c++) {
+        for (int i = 0; i < splatted[c].size(); i++) {
+            int pixel = splatted[c][i];
+            unsigned long long packed = splatBuffer[pixel].load(std::memory_order_relaxed);
+            splatBuffer[pixel].store(noSplat, std::memory_order_relaxed);
+            unsigned color = unsigned(packed);
+            Vector rgb((color >> 16) / 255.0, (color >> 8 & 255) / 255.0, (color & 255) / 255.0);
+            shadeFragment<F & (RASTER_MULTISAMPLE | RASTER_DEPTH_ONLY)>(
+                pixel % virtualWidth, pixel / virtualWidth, bitsDepth(unsigned(packed >> 32)), rgb, 0, 0);
+            total--;
+        }
+    }
+    stats.fragmentsGenerated += total;
+    stats.depthFails += total;
 }
 
 
-void myScale(double sx, double sy, double sz) {
-    // @@@@ YOUR CODE HERE
+// Clips the (projected) line from a to b to the part whose pixels are in the
+// virtual window, with the Liang-Barsky algorithm: each side of the window
+// narrows the range of the line's parameter (from 0 at a to 1 at b) that is
+// inside it. Returns false if none of it is.
+static bool clipLineToWindow(Vector const &a, Vector const &b, double &t0, double &t1) {
+    double dx = b[0] - a[0];
+    double dy = b[1] - a[1];
+    // The line is inside side i where p[i] * t <= q[i].
+    double p[4] = {-dx, dx, -dy, dy};
+    double q[4] = {
+        a[0] + 0.5, virtualWidth - 0.5 - a[0],
+        a[1] + 0.5, virtualHeight - 0.5 - a[1]
+    };
+    t0 = 0;
+    t1 = 1;
+    for (int i = 0; i < 4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0) {
+                return false;
+            }
+        } else if (p[i] < 0) {
+            t0 = std::max(t0, q[i] / p[i]);
+        } else {
+            t1 = std::min(t1, q[i] / p[i]);
+        }
+    }
+    return t0 <= t1;
 }
 
 
-void myFrustum(double left, double right, double bottom, double top, double near, double far) {
-    // @@@@ YOUR CODE HERE
+// Draws a line between two (projected) vertices. It is first clipped to the
+// virtual window, and then its pixels are found with Bresenham's algorithm in
+// integers, interpolating the attributes this variant uses with an add each
+// per pixel; every pixel stepped to is in the window, so none are checked.
+template <int F>
+static void rasterLine(PipelineVertex const &a, PipelineVertex const &b) {
+
+    double t0, t1;
+    if (!clipLineToWindow(a.position, b.position, t0, t1)) {
+        stats.primitivesCulled++;
+        return;
+    }
+    if (t0 > 0 || t1 < 1) {
+        stats.primitivesClipped++;
+    }
+
+    // The pixels the ends are in, which are in the window (but for rounding
+    // at its very edge). Every pixel between is in the box around them.
+    PipelineVertex const start = t0 > 0 ? lerpVertex(a, b, t0) : a;
+    PipelineVertex const end = t1 < 1 ? lerpVertex(a, b, t1) : b;
+    int x0 = std::max(0, std::min(virtualWidth - 1, int(floor(start.position[0] + 0.5))));
+    int y0 = std::max(0, std::min(virtualHeight - 1, int(floor(start.position[1] + 0.5))));
+    int x1 = std::max(0, std::min(virtualWidth - 1, int(floor(end.position[0] + 0.5))));
+    int y1 = std::max(0, std::min(virtualHeight - 1, int(floor(end.position[1] + 0.5))));
+
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int steps = std::max(dx, -dy);
+
+    // Every step moves one pixel along the major axis, so the attributes
+    // change by the same amount each time.
+    double scale = steps ? 1.0 / steps : 0;
+    double depth = start.position[2];
+    double depthStep = (end.position[2] - start.position[2]) * scale;
+    Vector color = start.color;
+    Vector colorStep = (end.color - start.color) * scale;
+    double u = start.texCoord[0], v = start.texCoord[1];
+    double uStep = (end.texCoord[0] - u) * scale;
+    double vStep = (end.texCoord[1] - v) * scale;
+
+    // The error is how far (scaled by 2 dx dy) the pixel is from the line.
+    for (int error = dx + dy; ; ) {
+        shadeFragment<F>(x0, y0, depth, color, u, v);
+        if (x0 == x1 && y0 == y1) {
+            break;
+        }
+        int twice = 2 * error;
+        if (twice >= dy) {
+            error += dy;
+            x0 += sx;
+        }
+        if (twice <= dx) {
+            error += dx;
+            y0 += sy;
+        }
+        depth += depthStep;
+        if (F & RASTER_TEXTURED) {
+            u += uStep;
+            v += vStep;
+        } else if (F & RASTER_SMOOTH) {
+            color[0] += colorStep[0];
+            color[1] += colorStep[1];
+            color[2] += colorStep[2];
+        }
+    }
 }
 
 
-void myLookAt(double eyeX, double eyeY, double eyeZ,
-              double cenX, double cenY, double cenZ,
-              double  upX, double  upY, double  upZ) {
-    // @@@@ YOUR CODE HERE
+// Twice the signed area of the triangle abc; positive if counter-clockwise.
+static double edgeFunction(double ax, double ay, double bx, double by, double px, double py) {
+    return (bx - ax) * (py - ay) - (by - ay) * (px - ax);
 }
 
 
-void myTexCoord(double s, double t) {
-    // @@@@ YOUR CODE HERE
+// An edge of a primitive, set up to tell which side of it pixel centers are
+// on. For an edge from a to b, side(x, y) is edgeFunction(a, b, pixel) times
+// the sign of the primitive's area, so positive inside; but it is worked out
+// the same way whichever end the edge is given from, so that it is exactly
+// zero for both or neither of two triangles sharing the edge, which so leave
+// no gaps between them.
+struct SpanEdge {
+    double ax, ay, dx, dy, invDy, sign;
+
+    // Is the inside to the right of the edge?
+    bool insideRight;
+
+    // edgeFunction() with its first term, which is the same along a row,
+    // found once for the row.
+    double row(int y) const { return dx * (y - ay); }
+    double side(double row, int x) const { return sign * (row - dy * (x - ax)); }
+};
+
+static SpanEdge spanEdge(Vector const &a, Vector const &b, double winding) {
+    bool flip = b[0] < a[0] || (b[0] == a[0] && b[1] < a[1]);
+    Vector const &p = flip ? b : a, &q = flip ? a : b;
+    SpanEdge edge = {p[0], p[1], q[0] - p[0], q[1] - p[1], 0, flip ? -winding : winding, false};
+    edge.invDy = edge.dy ? 1.0 / edge.dy : 0;
+    edge.insideRight = edge.dy * edge.sign < 0;
+    return edge;
 }
 
 
-void myNormal(double x, double y, double z) {
-    // @@@@ YOUR CODE HERE
+// Narrows the span [left, right] of row y down to the pixels inside (or on)
+// the edge, when the edge crosses the row within rounding of pixel below (or
+// below + 1), by stepping from there to where side() says the change is.
+static void clipSpanNear(SpanEdge const &edge, double row, int below, int minX, int maxX, int &left, int &right) {
+    if (edge.insideRight) {
+        int x = below + 1;
+        while (x > minX && edge.side(row, x - 1) >= 0) {
+            x--;
+        }
+        while (x <= maxX && edge.side(row, x) < 0) {
+            x++;
+        }
+        left = std::max(left, x);
+    } else {
+        int x = below;
+        while (x < maxX && edge.side(row, x + 1) >= 0) {
+            x++;
+        }
+        while (x >= minX && edge.side(row, x) < 0) {
+            x--;
+        }
+        right = std::min(right, x);
+    }
 }
 
+
+// Narrows the span [left, right] of row y (a part of the pixels from minX to
+// maxX) down to the pixels inside (or on) the edge. Along a row a pixel's
+// side changes only once, where the edge crosses the row; only if that is
+// within rounding of a pixel's center does side() need to be checked. The
+// edges of a primitive are independent until their spans are combined, so
+// can be worked out at once.
+static inline void clipSpan(SpanEdge const &edge, int y, int minX, int maxX, int &left, int &right) {
+    double row = edge.row(y);
+    if (!edge.dy) {
+        if (edge.side(row, minX) < 0) {
+            right = minX - 1;
+        }
+        return;
+    }
+    double cross = edge.ax + row * edge.invDy;
+    if (!(cross > minX - 1 && cross < maxX + 1)) {
+        // Outside the box (or not a number, if too far outside).
+        cross = cross > minX - 1 ? maxX + 1 : minX - 1;
+        clipSpanNear(edge, row, int(cross), minX, maxX, left, right);
+        return;
+    }
+    int below = int(cross + 1) - 1;
+    double fraction = cross - below;
+    double tolerance = 1e-9 * (1 + fabs(edge.ax) + fabs(cross));
+    if (fraction <= tolerance || fraction >= 1 - tolerance) {
+        clipSpanNear(edge, row, below, minX, maxX, left, right);
+    } else if (edge.insideRight) {
+        left = std::max(left, below + 1);
+    } else {
+        right = std::min(right, below);
+    }
+}
+
+
+// The pixels of a box, from minX to maxX and minY to maxY.
+struct PixelBox {
+    int minX, maxX, minY, maxY;
+};
+
+
+// The box of pixels with samples (reach away from their centers) that could
+// be inside the triangle abc, and that box clamped to the virtual window.
+static void triangleBox(Vector const &a, Vector const &b, Vector const &c, double reach,
+                        PixelBox &box, PixelBox &clamped) {
+    box.minX = int(ceil(std::min(a[0], std::min(b[0], c[0])) - reach));
+    box.maxX = int(floor(std::max(a[0], std::max(b[0], c[0])) + reach));
+    box.minY = int(ceil(std::min(a[1], std::min(b[1], c[1])) - reach));
+    box.maxY = int(floor(std::max(a[1], std::max(b[1], c[1])) + reach));
+    clamped.minX = std::max(0, box.minX);
+    clamped.maxX = std::min(virtualWidth - 1, box.maxX);
+    clamped.minY = std::max(0, box.minY);
+    clamped.maxY = std::min(virtualHeight - 1, box.maxY);
+}
+
+
+// Sets up the edges of the triangle abc, given twice its signed area.
+static void triangleEdges(Vector const &a, Vector const &b, Vector const &c, double area, SpanEdge *edges) {
+    double winding = area > 0 ? 1 : -1;
+    edges[0] = spanEdge(a, b, winding);
+    edges[1] = spanEdge(b, c, winding);
+    edges[2] = spanEdge(c, a, winding);
+}
+
+
+// Finds the pixels of row y of a box (clamped to the window) that are inside
+// the triangle with the given edges; left is greater than right if none are.
+// As a triangle is convex, they are all next to each other.
+static inline void triangleSpan(SpanEdge const *edges, PixelBox const &box, int y, int &left, int &right) {
+    left = box.minX;
+    right = box.maxX;
+    for (int i = 0; i < 3; i++) {
+        clipSpan(edges[i], y, box.minX, box.maxX, left, right);
+    }
+}
+
+
+// A quantity that varies linearly across the screen, relative to some origin
+// pixel: its value at an offset (x, y) from there is at(x, y).
+struct AttributePlane {
+    double value, dx, dy;
+    double at(double x, double y) const { return value + dx * x + dy * y; }
+};
+
+
+// The plane of an attribute with the given values at a triangle's vertices,
+// from the planes of the triangle's first two barycentric coordinates.
+static AttributePlane attributePlane(AttributePlane const &l0, AttributePlane const &l1,
+                                     double f0, double f1, double f2) {
+    AttributePlane plane = {
+        f2 + (f0 - f2) * l0.value + (f1 - f2) * l1.value,
+        (f0 - f2) * l0.dx + (f1 - f2) * l1.dx,
+        (f0 - f2) * l0.dy + (f1 - f2) * l1.dy
+    };
+    return plane;
+}
+
+
+// How far a triangle's first two barycentric coordinates, and its depth, are
+// from their values at a pixel's center at each of its samples.
+struct SampleOffsets {
+    double l0[samplesPerPixel], l1[samplesPerPixel], depth[samplesPerPixel];
+};
+
+
+// Which samples (as bits) of the pixel where the triangle's first two
+// barycentric coordinates are e0 and e1 (at its center) are inside it. The
+// same few operations are done for every sample, without branches, so that
+// the compiler can evaluate them side by side.
+static inline int sampleCoverage(double e0, double e1, SampleOffsets const &offsets) {
+    int mask = 0;
+    for (int s = 0; s < samplesPerPixel; s++) {
+        double s0 = e0 + offsets.l0[s];
+        double s1 = e1 + offsets.l1[s];
+        mask |= int(s0 >= 0 && s1 >= 0 && 1.0 - s0 - s1 >= 0) << s;
+    }
+    return mask;
+}
+
+
+// What a raster variant interpolates across a span: depth, the color (if
+// smooth), and 1/w, u/w and v/w (if textured; without perspective correction,
+// w is 1).
+struct SpanAttributes {
+    double depth, r, g, b, invW, uw, vw;
+};
+
+
+// For finding which samples of each pixel of a span a triangle covers, when
+// multisampling: its first two barycentric coordinates at the first pixel,
+// how much they change per pixel, and where the samples are.
+struct SpanCoverage {
+    double e0, e1, de0, de1;
+    SampleOffsets const *offsets;
+};
+
+
+// Draws the pixels of row y from left to right, given the attributes at the
+// left end and how much each changes per pixel (and flatColor, for variants
+// that do not interpolate color). Each attribute takes an add per pixel, and
+// a reciprocal for perspective correct textures (or one every few pixels with
+// RASTER_SPANS).
+template <int F>
+static inline void rasterSpan(int y, int left, int right, SpanAttributes at, SpanAttributes const &step,
+                              Vector const &flatColor, SpanCoverage coverage) {
+
+    Vector color = flatColor;
+    double u = 0, v = 0;
+
+    // With RASTER_SPANS, the true texture coordinates are found at the
+    // ends of each short span, and interpolated affinely between them.
+    int spanEnd = left;
+    double uEnd = 0, vEnd = 0, du = 0, dv = 0;
+
+    for (int x = left; x <= right; x++) {
+
+        // The ends of each span are found whether or not its fragments
+        // pass; everything else only once the depth test has passed.
+        if ((F & RASTER_TEXTURED) && (F & RASTER_PERSPECTIVE) && (F & RASTER_SPANS)) {
+            if (x == spanEnd) {
+                if (x == left) {
+                    double w = 1.0 / at.invW;
+                    u = at.uw * w;
+                    v = at.vw * w;
+                } else {
+                    u = uEnd;
+                    v = vEnd;
+                }
+                int length = std::min(perspectiveSpanLength, right - x);
+                spanEnd = x + length;
+                if (length) {
+                    double w = 1.0 / (at.invW + step.invW * length);
+                    uEnd = (at.uw + step.uw * length) * w;
+                    vEnd = (at.vw + step.vw * length) * w;
+                    du = (uEnd - u) / length;
+                    dv = (vEnd - v) / length;
+                }
+            }
+        }
+
+        int mask = 1;
+        if (F & RASTER_MULTISAMPLE) {
+            mask = sampleCoverage(coverage.e0, coverage.e1, *coverage.offsets);
+            if (mask) {
+                mask = depthTest<F>(x, y, at.depth, mask, coverage.offsets->depth);
+            }
+        } else {
+            mask = depthTest<F>(x, y, at.depth);
+        }
+        if (mask) {
+            if (F & RASTER_TEXTURED) {
+                if (!(F & RASTER_PERSPECTIVE)) {
+                    u = at.uw;
+                    v = at.vw;
+                } else if (!(F & RASTER_SPANS)) {
+                    double w = 1.0 / at.invW;
+                    u = at.uw * w;
+                    v = at.vw * w;
+                }
+            } else if (F & RASTER_SMOOTH) {
+                color[0] = at.r;
+                color[1] = at.g;
+                color[2] = at.b;
+            }
+            writeFragment<F>(x, y, color, u, v, mask);
+        }
+
+        at.depth += step.depth;
+        if (F & RASTER_MULTISAMPLE) {
+            coverage.e0 += coverage.de0;
+            coverage.e1 += coverage.de1;
+        }
+        if (F & RASTER_TEXTURED) {
+            if (F & RASTER_SPANS) {
+                u += du;
+                v += dv;
+            }
+            at.invW += step.invW;
+            at.uw += step.uw;
+            at.vw += step.vw;
+        } else if (F & RASTER_SMOOTH) {
+            at.r += step.r;
+            at.g += step.g;
+            at.b += step.b;
+        }
+    }
+}
+
+
+// Draws a (projected) triangle a row at a time. Every attribute is set up once
+// as a plane, so that each span starts from the planes' values and steps by
+// their slopes (see rasterSpan). When multisampling, the pixels with any sample inside are
+// drawn, but every attribute is still found at the pixel's center.
+template <int F>
+static void rasterTriangle(PipelineVertex const &a, PipelineVertex const &b, PipelineVertex const &c) {
+
+    double area = edgeFunction(a.position[0], a.position[1],
+                               b.position[0], b.position[1],
+                               c.position[0], c.position[1]);
+    if (area == 0) {
+        stats.primitivesCulled++;
+        return;
+    }
+
+    // The bounding box (of pixels with samples within the triangle), clamped
+    // to the virtual window.
+    PixelBox box, clamped;
+    triangleBox(a.position, b.position, c.position, F & RASTER_MULTISAMPLE ? sampleReach : 0, box, clamped);
+    int minX = clamped.minX, maxX = clamped.maxX, minY = clamped.minY, maxY = clamped.maxY;
+    if (minX > maxX || minY > maxY) {
+        stats.primitivesCulled++;
+        return;
+    }
+    if (minX != box.minX || maxX != box.maxX || minY != box.minY || maxY != box.maxY) {
+        stats.primitivesClipped++;
+    }
+
+    // Keep what is needed to shade the triangle later.
+    if (F & RASTER_VISIBILITY) {
+        VisibleTriangle triangle = {a, b, c, currentTexture, visibilityFeatures};
+        currentTriangleId = visibleTriangles.size();
+        visibleTriangles.push_back(triangle);
+    }
+
+    // Planes of the barycentric coordinates of a and b (that of c is what is
+    // left over), relative to the corner of the box.
+    AttributePlane l0 = {
+        edgeFunction(b.position[0], b.position[1], c.position[0], c.position[1], minX, minY) / area,
+        (b.position[1] - c.position[1]) / area,
+        (c.position[0] - b.position[0]) / area
+    };
+    AttributePlane l1 = {
+        edgeFunction(c.position[0], c.position[1], a.position[0], a.position[1], minX, minY) / area,
+        (c.position[1] - a.position[1]) / area,
+        (a.position[0] - c.position[0]) / area
+    };
+
+    // Planes of every attribute this variant uses. Perspective correct
+    // texture coordinates are found from u/w and v/w, which (unlike u and v)
+    // are linear in screen space, by dividing by 1/w.
+    AttributePlane depthPlane = attributePlane(l0, l1, a.position[2], b.position[2], c.position[2]);
+    AttributePlane colorPlanes[3], texPlanes[2], invWPlane = {1, 0, 0};
+    if (F & RASTER_TEXTURED) {
+        double w0 = 1, w1 = 1, w2 = 1;
+        if (F & RASTER_PERSPECTIVE) {
+            w0 = a.position[3];
+            w1 = b.position[3];
+            w2 = c.position[3];
+            invWPlane = attributePlane(l0, l1, w0, w1, w2);
+        }
+        for (int i = 0; i < 2; i++) {
+            texPlanes[i] = attributePlane(l0, l1, a.texCoord[i] * w0, b.texCoord[i] * w1, c.texCoord[i] * w2);
+        }
+    } else if (F & RASTER_SMOOTH) {
+        for (int i = 0; i < 3; i++) {
+            colorPlanes[i] = attributePlane(l0, l1, a.color[i], b.color[i], c.color[i]);
+        }
+    }
+
+    // The edges, to find which pixels are inside when not multisampling
+    // (see SpanEdge).
+    SpanEdge edges[3];
+    if (!(F & RASTER_MULTISAMPLE)) {
+        triangleEdges(a.position, b.position, c.position, area, edges);
+    }
+
+    // Where the samples are relative to each pixel's center.
+    SampleOffsets offsets;
+    if (F & RASTER_MULTISAMPLE) {
+        for (int s = 0; s < samplesPerPixel; s++) {
+            double ox = sampleOffsets[s][0], oy = sampleOffsets[s][1];
+            offsets.l0[s] = l0.dx * ox + l0.dy * oy;
+            offsets.l1[s] = l1.dx * ox + l1.dy * oy;
+            offsets.depth[s] = depthPlane.dx * ox + depthPlane.dy * oy;
+        }
+    }
+
+    for (int y = minY; y <= maxY; y++) {
+        double dy = y - minY;
+
+        // Find the pixels of this row within the triangle, which (as it is
+        // convex) are all next to each other. When multisampling, a pixel is
+        // in if any of its samples is, and those pixels may have gaps (in
+        // slivers thinner than the samples are apart), so the ends are found
+        // from both sides and the pixels between checked again.
+        int left = maxX + 1, right = maxX;
+        if (F & RASTER_MULTISAMPLE) {
+            for (left = minX; left <= maxX; left++) {
+                if (sampleCoverage(l0.at(left - minX, dy), l1.at(left - minX, dy), offsets)) {
+                    break;
+                }
+            }
+            for (right = maxX; right > left; right--) {
+                if (sampleCoverage(l0.at(right - minX, dy), l1.at(right - minX, dy), offsets)) {
+                    break;
+                }
+            }
+        } else {
+            triangleSpan(edges, clamped, y, left, right);
+        }
+        if (left > right) {
+            continue;
+        }
+
+        // Step every attribute along the span.
+        double dx = left - minX;
+        SpanAttributes at = {depthPlane.at(dx, dy)}, step = {depthPlane.dx};
+        if (F & RASTER_TEXTURED) {
+            at.invW = invWPlane.at(dx, dy);
+            at.uw = texPlanes[0].at(dx, dy);
+            at.vw = texPlanes[1].at(dx, dy);
+            step.invW = invWPlane.dx;
+            step.uw = texPlanes[0].dx;
+            step.vw = texPlanes[1].dx;
+        } else if (F & RASTER_SMOOTH) {
+            at.r = colorPlanes[0].at(dx, dy);
+            at.g = colorPlanes[1].at(dx, dy);
+            at.b = colorPlanes[2].at(dx, dy);
+            step.r = colorPlanes[0].dx;
+            step.g = colorPlanes[1].dx;
+            step.b = colorPlanes[2].dx;
+        }
+        SpanCoverage coverage = {0, 0, l0.dx, l1.dx, &offsets};
+        if (F & RASTER_MULTISAMPLE) {
+            coverage.e0 = l0.at(dx, dy);
+            coverage.e1 = l1.at(dx, dy);
+        }
+        rasterSpan<F>(y, left, right, at, step, a.color, coverage);
+    }
+}
+
+
+// Helpers for SpanAttributes: a + d * t, and (b - a) * scale.
+static inline SpanAttributes addScaled(SpanAttributes const &a, SpanAttributes const &d, double t) {
+    SpanAttributes result = {
+        a.depth + d.depth * t, a.r + d.r * t, a.g + d.g * t, a.b + d.b * t,
+        a.invW + d.invW * t, a.uw + d.uw * t, a.vw + d.vw * t
+    };
+    return result;
+}
+static inline SpanAttributes difference(SpanAttributes const &a, SpanAttributes const &b, double scale) {
+    SpanAttributes result = {
+        (b.depth - a.depth) * scale, (b.r - a.r) * scale, (b.g - a.g) * scale, (b.b - a.b) * scale,
+        (b.invW - a.invW) * scale, (b.uw - a.uw) * scale, (b.vw - a.vw) * scale
+    };
+    return result;
+}
+
+
+// The attributes a raster variant interpolates, at a (projected) vertex.
+template <int F>
+static SpanAttributes vertexAttributes(PipelineVertex const &v) {
+    SpanAttributes at = {v.position[2], 0, 0, 0, 0, 0, 0};
+    if (F & RASTER_TEXTURED) {
+        double w = F & RASTER_PERSPECTIVE ? v.position[3] : 1;
+        at.invW = w;
+        at.uw = v.texCoord[0] * w;
+        at.vw = v.texCoord[1] * w;
+    } else if (F & RASTER_SMOOTH) {
+        at.r = v.color[0];
+        at.g = v.color[1];
+        at.b = v.color[2];
+    }
+    return at;
+}
+
+
+// One side of a convex polygon as it is walked down a row at a time: the
+// vertices of the edge it is on, and its x and attributes at the current row,
+// along with how much each changes per row.
+struct PolygonEdge {
+    int from, to;
+    double x, dx;
+    SpanAttributes at, step;
+};
+
+
+// Puts a side of a polygon on the edge between the given vertices, at row y.
+static void startEdge(PolygonEdge &edge, PipelineVertex const *v, SpanAttributes const *attributes,
+                      int from, int to, double y) {
+    Vector const &a = v[from].position, &b = v[to].position;
+    double scale = b[1] > a[1] ? 1.0 / (b[1] - a[1]) : 0;
+    edge.from = from;
+    edge.to = to;
+    edge.dx = (b[0] - a[0]) * scale;
+    edge.x = a[0] + edge.dx * (y - a[1]);
+    edge.step = difference(attributes[from], attributes[to], scale);
+    edge.at = addScaled(attributes[from], edge.step, y - a[1]);
+}
+
+
+// The attributes of each vertex of the polygon being drawn, and the fan of
+// triangles (from its first vertex) it would be split into, each with its
+// edges and its box clamped to the virtual window.
+struct FanTriangle {
+    SpanEdge edges[3];
+    PixelBox box;
+};
+static std::vector<SpanAttributes> polygonAttributes;
+static std::vector<FanTriangle> polygonFan;
+
+
+// Draws a (projected) convex polygon a row at a time, without splitting it
+// into triangles. Its two sides are walked down from the top vertex to the
+// bottom one, each stepping its x and attributes by a constant per row, and
+// moving on to the next edge when it passes a vertex; the pixels between them
+// are then drawn as a span, across which the attributes are interpolated.
+// Which pixels those are is settled by the triangles of a fan from the first
+// vertex, found as rasterTriangle() would find them, so a polygon covers just
+// what it would if split up (as it is when multisampling, say).
+template <int F>
+static void rasterPolygon(PipelineVertex const *v, int n) {
+
+    // Twice the signed area, and the top and bottom vertices.
+    double area = 0;
+    int top = 0, bottom = 0;
+    for (int i = 0; i < n; i++) {
+        Vector const &p = v[i].position, &q = v[(i + 1) % n].position;
+        area += p[0] * q[1] - q[0] * p[1];
+        if (p[1] < v[top].position[1]) {
+            top = i;
+        }
+        if (p[1] > v[bottom].position[1]) {
+            bottom = i;
+        }
+    }
+    if (area == 0) {
+        stats.primitivesCulled++;
+        return;
+    }
+
+    // The bounding box, clamped to the virtual window.
+    double left = DBL_MAX, right = -DBL_MAX;
+    for (int i = 0; i < n; i++) {
+        left = std::min(left, v[i].position[0]);
+        right = std::max(right, v[i].position[0]);
+    }
+    int boxMinX = int(ceil(left));
+    int boxMaxX = int(floor(right));
+    int boxMinY = int(ceil(v[top].position[1]));
+    int boxMaxY = int(floor(v[bottom].position[1]));
+    int minX = std::max(0, boxMinX);
+    int maxX = std::min(virtualWidth - 1, boxMaxX);
+    int minY = std::max(0, boxMinY);
+    int maxY = std::min(virtualHeight - 1, boxMaxY);
+    if (minX > maxX || minY > maxY) {
+        stats.primitivesCulled++;
+        return;
+    }
+    if (minX != boxMinX || maxX != boxMaxX || minY != boxMinY || maxY != boxMaxY) {
+        stats.primitivesClipped++;
+    }
+
+    polygonAttributes.resize(n);
+    for (int i = 0; i < n; i++) {
+        polygonAttributes[i] = vertexAttributes<F>(v[i]);
+    }
+    polygonFan.clear();
+    for (int i = 2; i < n; i++) {
+        Vector const &a = v[0].position, &b = v[i - 1].position, &c = v[i].position;
+        double fanArea = edgeFunction(a[0], a[1], b[0], b[1], c[0], c[1]);
+        FanTriangle triangle;
+        PixelBox box;
+        triangleBox(a, b, c, 0, box, triangle.box);
+        if (fanArea != 0 && triangle.box.minX <= triangle.box.maxX && triangle.box.minY <= triangle.box.maxY) {
+            triangleEdges(a, b, c, fanArea, triangle.edges);
+            polygonFan.push_back(triangle);
+        }
+    }
+    SpanAttributes const *attributes = &polygonAttributes[0];
+
+    // One side goes forwards around the polygon from the top, the other
+    // backwards; which is on the left does not matter.
+    PolygonEdge sides[2];
+    int const directions[2] = {1, n - 1};
+    for (int side = 0; side < 2; side++) {
+        sides[side].from = top;
+        sides[side].to = (top + directions[side]) % n;
+    }
+
+    SpanCoverage coverage = {0, 0, 0, 0, NULL};
+    for (int y = minY; y <= maxY; y++) {
+
+        // Step each side down a row, or onto the edge this row crosses (when
+        // starting, or once past the vertex it was heading for). Edges that
+        // end on the row are passed over for the next, which starts there,
+        // but for the last.
+        for (int side = 0; side < 2; side++) {
+            PolygonEdge &edge = sides[side];
+            if (y == minY || (edge.to != bottom && v[edge.to].position[1] <= y)) {
+                int from = edge.from, to = edge.to;
+                while (to != bottom && v[to].position[1] <= y) {
+                    from = to;
+                    to = (to + directions[side]) % n;
+                }
+                startEdge(edge, v, attributes, from, to, y);
+            } else {
+                edge.x += edge.dx;
+                edge.at = addScaled(edge.at, edge.step, 1);
+            }
+        }
+
+        PolygonEdge const *l = &sides[0], *r = &sides[1];
+        if (l->x > r->x) {
+            std::swap(l, r);
+        }
+        // The span covers the pixels the fan's triangles do in this row,
+        // rather than those between the sides (whose x drift by rounding).
+        int spanLeft = maxX + 1, spanRight = minX - 1;
+        for (int i = 0; i < polygonFan.size(); i++) {
+            FanTriangle const &triangle = polygonFan[i];
+            int left, right;
+            if (y >= triangle.box.minY && y <= triangle.box.maxY) {
+                triangleSpan(triangle.edges, triangle.box, y, left, right);
+                if (left <= right) {
+                    spanLeft = std::min(spanLeft, left);
+                    spanRight = std::max(spanRight, right);
+                }
+            }
+        }
+        if (spanLeft > spanRight) {
+            continue;
+        }
+        double width = r->x - l->x;
+        SpanAttributes step = difference(l->at, r->at, width > 0 ? 1.0 / width : 0);
+        rasterSpan<F>(y, spanLeft, spanRight, addScaled(l->at, step, spanLeft - l->x), step, v[0].color, coverage);
+    }
+}
+
+
+// Points closer to the eye than this (in w) are clipped away.
+static double const nearW = 1e-5;
+
+
+// Clips a line against the near plane, then projects and draws it.
+template <int F>
+static void drawLine(PipelineVertex a, PipelineVertex b) {
+    double wa = a.position[3] - nearW;
+    double wb = b.position[3] - nearW;
+    if (wa < 0 && wb < 0) {
+        stats.primitivesCulled++;
+        return;
+    }
+    if (wa < 0) {
+        stats.primitivesClipped++;
+        a = lerpVertex(a, b, wa / (wa - wb));
+    } else if (wb < 0) {
+        stats.primitivesClipped++;
+        b = lerpVertex(a, b, wa / (wa - wb));
+    }
+    project(a);
+    project(b);
+    rasterLine<F>(a, b);
+}
+
+
+// Clips a triangle against the near plane (which may turn it into a quad),
+// then projects and draws it.
+template <int F>
+static void drawTriangle(PipelineVertex const &a, PipelineVertex const &b, PipelineVertex const &c) {
+
+    PipelineVertex const *in[3] = {&a, &b, &c};
+    PipelineVertex out[4];
+    int count = 0;
+
+    for (int i = 0; i < 3; i++) {
+        PipelineVertex const &p = *in[i];
+        PipelineVertex const &q = *in[(i + 1) % 3];
+        double wp = p.position[3] - nearW;
+        double wq = q.position[3] - nearW;
+        if (wp >= 0) {
+            out[count++] = p;
+        }
+        if ((wp >= 0) != (wq >= 0)) {
+            out[count++] = lerpVertex(p, q, wp / (wp - wq));
+        }
+    }
+
+    if (!count) {
+        stats.primitivesCulled++;
+        return;
+    }
+    if (count != 3 || a.position[3] < nearW || b.position[3] < nearW || c.position[3] < nearW) {
+        stats.primitivesClipped++;
+    }
+
+    for (int i = 0; i < count; i++) {
+        project(out[i]);
+    }
+    for (int i = 2; i < count; i++) {
+        rasterTriangle<F>(out[0], out[i - 1], out[i]);
+    }
+}
+
+
+// Clips a convex polygon against the near plane, then projects and draws it
+// whole. Triangles (and, as multisampling and the visibility buffer need
+// triangles, everything drawn with those) are drawn as a fan of triangles.
+template <int F>
+static void drawPolygon(PipelineVertex const *in, int n) {
+
+    static std::vector<PipelineVertex> out;
+    out.clear();
+    bool clipped = false;
+
+    for (int i = 0; i < n; i++) {
+        PipelineVertex const &p = in[i];
+        PipelineVertex const &q = in[(i + 1) % n];
+        double wp = p.position[3] - nearW;
+        double wq = q.position[3] - nearW;
+        if (wp >= 0) {
+            out.push_back(p);
+        } else {
+            clipped = true;
+        }
+        if ((wp >= 0) != (wq >= 0)) {
+            out.push_back(lerpVertex(p, q, wp / (wp - wq)));
+        }
+    }
+
+    if (out.empty()) {
+        stats.primitivesCulled++;
+        return;
+    }
+    if (clipped) {
+        stats.primitivesClipped++;
+    }
+
+    for (int i = 0; i < out.size(); i++) {
+        project(out[i]);
+    }
+    if (out.size() == 3 || (F & (RASTER_MULTISAMPLE | RASTER_VISIBILITY))) {
+        for (int i = 2; i < out.size(); i++) {
+            rasterTriangle<F>(out[0], out[i - 1], out[i]);
+        }
+    } else {
+        rasterPolygon<F>(&out[0], out.size());
+    }
+}
+
+
+// Draws each of the given vertices as a point, if it is in front of the eye,
+// by splatting them (see splatPoints). Textured points are colored by the
+// texel at their texture coordinates.
+template <int F>
+static void drawPoints(PipelineVertex const *v, int n) {
+    splatPoints<F>(n, [v](int begin, int end, Splat *splats) {
+        int count = 0;
+        for (int i = begin; i < end; i++) {
+            if (v[i].position[3] < nearW) {
+                continue;
+            }
+            PipelineVertex p = v[i];
+            project(p);
+            int x = int(floor(p.position[0] + 0.5));
+            int y = int(floor(p.position[1] + 0.5));
+            if (x < 0 || x >= virtualWidth || y < 0 || y >= virtualHeight) {
+                continue;
+            }
+            Splat &splat = splats[count++];
+            splat.pixel = y * virtualWidth + x;
+            splat.depth = float(p.position[2]);
+            splat.color = packColor(F & RASTER_TEXTURED ?
+                currentTexture->lookup(p.texCoord[0], p.texCoord[1]) : p.color);
+        }
+        return count;
+    });
+}
+
+// The primitive functions of one raster pipeline variant.
+struct RasterPipeline {
+    void (*points)(PipelineVertex const *v, int n);
+    void (*line)(PipelineVertex a, PipelineVertex b);
+    void (*triangle)(PipelineVertex const &a, PipelineVertex const &b, PipelineVertex const &c);
+    void (*polygon)(PipelineVertex const *v, int n);
+};
+
+#define RASTER_PIPELINE(F) {drawPoints<F>, drawLine<F>, drawTriangle<F>, drawPolygon<F>}
+
+// Every raster pipeline variant, indexed by its RasterFeature bits.
+static RasterPipeline const rasterPipelines[] = {
+    RASTER_PIPELINE(0), RASTER_PIPELINE(1), RASTER_PIPELINE(2), RASTER_PIPELINE(3),
+    RASTER_PIPELINE(4), RASTER_PIPELINE(5), RASTER_PIPELINE(6), RASTER_PIPELINE(7),
+    RASTER_PIPELINE(8), RASTER_PIPELINE(9), RASTER_PIPELINE(10), RASTER_PIPELINE(11),
+    RASTER_PIPELINE(12), RASTER_PIPELINE(13), RASTER_PIPELINE(14), RASTER_PIPELINE(15),
+    RASTER_PIPELINE(16), RASTER_PIPELINE(17), RASTER_PIPELINE(18), RASTER_PIPELINE(19),
+    RASTER_PIPELINE(20), RASTER_PIPELINE(21), RASTER_PIPELINE(22), RASTER_PIPELINE(23),
+    RASTER_PIPELINE(24), RASTER_PIPELINE(25), RASTER_PIPELINE(26), RASTER_PIPELINE(27),
+    RASTER_PIPELINE(28), RASTER_PIPELINE(29), RASTER_PIPELINE(30), RASTER_PIPELINE(31)
+};
+static_assert(sizeof(rasterPipelines) / sizeof(rasterPipelines[0]) == rasterVariants,
+              "there must be a raster pipeline for every combination of features");
+
+// The pipelines for a depth prepass, and for filling the visibility buffer,
+// without and with multisampling.
+static RasterPipeline const depthOnlyPipelines[2] = {
+    RASTER_PIPELINE(RASTER_DEPTH_ONLY), RASTER_PIPELINE(RASTER_DEPTH_ONLY | RASTER_MULTISAMPLE)
+};
+static RasterPipeline const visibilityPipelines[2] = {
+    RASTER_PIPELINE(RASTER_VISIBILITY), RASTER_PIPELINE(RASTER_VISIBILITY | RASTER_MULTISAMPLE)
+};
+
+#undef RASTER_PIPELINE
+
+
+// Picks the raster pipeline variant (as RasterFeature flags) that does no
+// more than the given batch needs.
+static int rasterFeatures(PipelineVertex const *v, int n) {
+    int features = multisampling ? RASTER_MULTISAMPLE : 0;
+    if (currentTexture && currentTexture->good()) {
+        features |= RASTER_TEXTURED;
+        if (perspectiveCorrectTextures) {
+            features |= RASTER_PERSPECTIVE;
+            if (perspectiveSpanLength > 1) {
+                features |= RASTER_SPANS;
+            }
+        }
+    } else {
+        for (int i = 1; i < n; i++) {
+            if (v[i].color[0] != v[0].color[0] || v[i].color[1] != v[0].color[1] ||
+                v[i].color[2] != v[0].color[2]) {
+                features |= RASTER_SMOOTH;
+                break;
+            }
+        }
+    }
+    return features;
+}
+
+
+
+// Multiplies the model-view matrix by the given matrix, or folds it into the
+// display list being recorded.
+static void multModelView(Matrix const &m);
+
+// The model-view matrix, or the transform of the display list being recorded;
+// and setting it back to one it was.
+static Matrix const &currentModelView();
+static void restoreModelView(Matrix const &m);
+
+
+// Display lists are stored as a compact stream of opcodes, each followed by
+// its operands (kept as doubles, so that replaying a list draws exactly what
+// drawing immediately would have). Positions are stored pre-transformed into the list's model
+// space (i.e. with any myTranslate/myRotate/myScale given while recording
+// already applied) and redundant state changes are dropped, so that replaying
+// a list costs little more than the transform and raster work itself.
+enum ListOpCode {
+    LIST_BEGIN,
+    LIST_END,
+    LIST_COLOR,
+    LIST_TEX_COORD,
+    LIST_NORMAL,
+    LIST_VERTEX,
+    LIST_TEXTURE,
+    LIST_MULT_MATRIX,
+    LIST_ENABLE,
+    LIST_DISABLE,
+    LIST_LIGHT,
+    LIST_MATERIAL,
+    LIST_END_INSTANCED,
+    LIST_DRAW_POINTS
+};
+
+
+class DisplayList {
+private:
+
+    std::vector<unsigned char> data_;
+
+public:
+
+    void clear() { data_.clear(); }
+
+    // Append an opcode.
+    void op(ListOpCode code) {
+        data_.push_back((unsigned char)code);
+    }
+
+    // Append an operand of any plain type.
+    template <class T> void operand(T const &value) {
+        size_t offset = data_.size();
+        data_.resize(offset + sizeof(T));
+        memcpy(&data_[offset], &value, sizeof(T));
+    }
+
+    // Append an opcode with up to four double operands.
+    void op(ListOpCode code, int count, double a, double b=0, double c=0, double d=0) {
+        op(code);
+        double values[4] = {a, b, c, d};
+        for (int i = 0; i < count; i++) {
+            operand(values[i]);
+        }
+    }
+
+    // Decode an operand at the given offset, and move the offset past it.
+    template <class T> T read(size_t &offset) const {
+        T value;
+        memcpy(&value, &data_[offset], sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    // Insert raw bytes at the given offset.
+    void insert(size_t offset, unsigned char const *bytes, size_t count) {
+        data_.insert(data_.begin() + offset, bytes, bytes + count);
+    }
+
+    size_t size() const { return data_.size(); }
+    unsigned char at(size_t offset) const { return data_[offset]; }
+
+};
+
+
+// All display lists, looked up by name; and the next name to hand out.
+static std::map<int,DisplayList> displayLists;
+static int nextListName = 1;
+
+
+// State for the display list being recorded (if recordingList is non-NULL).
+static DisplayList *recordingList = NULL;
+static struct {
+
+    // Transformations given while recording, and the matrices pushed with
+    // myPushMatrix; they are applied to positions and normals as they are
+    // recorded. The inverse-transpose for normals is only recomputed when
+    // the transform changes.
+    Matrix transform;
+    Matrix stack[maxStackDepth];
+    int stackDepth;
+    Matrix normalTransform;
+    bool normalTransformIsDirty;
+
+    // The last state we put into the list, so redundant changes can be
+    // dropped.
+    double color[3], texCoord[2], normal[3];
+    bool hasColor, hasTexCoord, hasNormal;
+    Image *texture;
+    bool hasTexture;
+
+    // The primitive type of the last myBegin, and whether its myEnd has
+    // been deferred in case the next myBegin can be merged with it. If it
+    // was merged, where its own LIST_BEGIN would have gone. And how many
+    // vertices have been recorded since the last LIST_BEGIN.
+    int primitive;
+    int vertices;
+    bool endPending;
+    bool merged;
+    size_t batchStart;
+
+} recorder;
+
+
+// Writes out a deferred LIST_END, if there is one.
+static void flushPendingEnd() {
+    if (recorder.endPending) {
+        recordingList->op(LIST_END);
+        recorder.endPending = false;
+    }
+}
+
+
+// Records a state change if it differs from the last recorded one.
+static void recordState(ListOpCode code, int count, double *last, bool &hasLast, double const *values) {
+    if (hasLast) {
+        bool same = true;
+        for (int i = 0; i < count; i++) {
+            same = same && last[i] == values[i];
+        }
+        if (same) {
+            return;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        last[i] = values[i];
+    }
+    hasLast = true;
+    recordingList->op(code, count, values[0], count > 1 ? values[1] : 0, count > 2 ? values[2] : 0);
+}
+
+
+// How many vertices each primitive of a type that can be merged takes, or 0
+// for types whose batches cannot be merged.
+static int mergeablePrimitiveSize(int type) {
+    switch (type) {
+        case GL_POINTS:
+            return 1;
+        case GL_LINES:
+            return 2;
+        case GL_TRIANGLES:
+            return 3;
+        case GL_QUADS:
+            return 4;
+    }
+    return 0;
+}
+
+
+void myBegin(int type) {
+    if (recordingList) {
+        // Separate batches of independent primitives can be merged into one,
+        // unless the last ended partway through a primitive (which would then
+        // be completed by this batch's vertices, rather than dropped).
+        int size = mergeablePrimitiveSize(type);
+        recorder.batchStart = recordingList->size();
+        recorder.merged = recorder.endPending && size && type == recorder.primitive &&
+                          recorder.vertices % size == 0;
+        if (recorder.merged) {
+            recorder.endPending = false;
+        } else {
+            flushPendingEnd();
+            recordingList->op(LIST_BEGIN);
+            recordingList->operand(type);
+            recorder.vertices = 0;
+        }
+        recorder.primitive = type;
+        return;
+    }
+    currentPrimitive = type;
+    vertexBatch.clear();
+}
+
+
+void myColor(double r, double g, double b) {
+    if (recordingList) {
+        double values[3] = {r, g, b};
+        recordState(LIST_COLOR, 3, recorder.color, recorder.hasColor, values);
+        return;
+    }
+    currentColor = Vector(r, g, b);
+}
+
+
+// Adds a vertex with the given homogeneous position to the batch, or to the
+// list being recorded (as replaying one must keep w, which a list's
+// transformations may have changed).
+static void addVertex(Vector const &position) {
+    if (recordingList) {
+        Vector p = recorder.transform * position;
+        recordingList->op(LIST_VERTEX, 4, p[0], p[1], p[2], p[3]);
+        recorder.vertices++;
+        return;
+    }
+    stats.verticesSubmitted++;
+    PipelineVertex v;
+    v.position = position;
+    v.normal = currentNormal;
+    v.color = currentColor;
+    v.texCoord[0] = currentTextureCoord[0];
+    v.texCoord[1] = currentTextureCoord[1];
+    vertexBatch.push_back(v);
+}
+
+
+void myVertex(double x, double y, double z) {
+    addVertex(Vector(x, y, z, 1));
+}
+
+
+// Scratch space for the lighting stage. It works on a structure of arrays
+// (one per component) rather than on PipelineVertex, so that each step is a
+// plain loop over contiguous doubles which the compiler can vectorize.
+static struct {
+    std::vector<double> px, py, pz, pw;
+    std::vector<double> nx, ny, nz;
+    std::vector<double> ar, ag, ab;
+    std::vector<double> dr, dg, db;
+    std::vector<double> r, g, b;
+} lighting;
+
+
+// Multiplies the points with the given w (which are then divided through by
+// their new w, as a list's transformations may leave w other than 1), or
+// directions (if w is NULL), in the given arrays by m.
+static void transformArrays(Matrix const &m, double const *w,
+                            double *x, double *y, double *z, int n) {
+    double m00 = m[0][0], m01 = m[0][1], m02 = m[0][2], m03 = m[0][3];
+    double m10 = m[1][0], m11 = m[1][1], m12 = m[1][2], m13 = m[1][3];
+    double m20 = m[2][0], m21 = m[2][1], m22 = m[2][2], m23 = m[2][3];
+    double m30 = m[3][0], m31 = m[3][1], m32 = m[3][2], m33 = m[3][3];
+    if (!w) {
+        for (int i = 0; i < n; i++) {
+            double tx = m00 * x[i] + m01 * y[i] + m02 * z[i];
+            double ty = m10 * x[i] + m11 * y[i] + m12 * z[i];
+            double tz = m20 * x[i] + m21 * y[i] + m22 * z[i];
+            x[i] = tx;
+            y[i] = ty;
+            z[i] = tz;
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        double tx = m00 * x[i] + m01 * y[i] + m02 * z[i] + m03 * w[i];
+        double ty = m10 * x[i] + m11 * y[i] + m12 * z[i] + m13 * w[i];
+        double tz = m20 * x[i] + m21 * y[i] + m22 * z[i] + m23 * w[i];
+        double tw = m30 * x[i] + m31 * y[i] + m32 * z[i] + m33 * w[i];
+        x[i] = tx / tw;
+        y[i] = ty / tw;
+        z[i] = tz / tw;
+    }
+}
+
+
+// Adds one light's contribution to the colors being lit. The diffuse term is
+// Lambert's, and the specular term Blinn-Phong's with a viewer infinitely far
+// down -z (OpenGL's default).
+static void addLight(Light const &light, int n) {
+
+    double const *px = &lighting.px[0], *py = &lighting.py[0], *pz = &lighting.pz[0];
+    double const *nx = &lighting.nx[0], *ny = &lighting.ny[0], *nz = &lighting.nz[0];
+    double const *ar = &lighting.ar[0], *ag = &lighting.ag[0], *ab = &lighting.ab[0];
+    double const *dr = &lighting.dr[0], *dg = &lighting.dg[0], *db = &lighting.db[0];
+    double *r = &lighting.r[0], *g = &lighting.g[0], *b = &lighting.b[0];
+
+    bool directional = light.position[3] == 0;
+    Vector direction = Vector(light.position[0], light.position[1], light.position[2]).normalized();
+    double specular[3];
+    for (int j = 0; j < 3; j++) {
+        specular[j] = light.specular[j] * material.specular[j];
+    }
+    bool shiny = specular[0] || specular[1] || specular[2];
+
+    for (int i = 0; i < n; i++) {
+
+        // The direction to the light, and the half-way vector between it and
+        // the direction to the viewer.
+        double lx = direction[0], ly = direction[1], lz = direction[2];
+        if (!directional) {
+            lx = light.position[0] - px[i];
+            ly = light.position[1] - py[i];
+            lz = light.position[2] - pz[i];
+            double length = sqrt(lx * lx + ly * ly + lz * lz);
+            double scale = length > 0 ? 1 / length : 0;
+            lx *= scale;
+            ly *= scale;
+            lz *= scale;
+        }
+
+        double diffuse = std::max(0.0, nx[i] * lx + ny[i] * ly + nz[i] * lz);
+        r[i] += light.ambient[0] * ar[i] + light.diffuse[0] * dr[i] * diffuse;
+        g[i] += light.ambient[1] * ag[i] + light.diffuse[1] * dg[i] * diffuse;
+        b[i] += light.ambient[2] * ab[i] + light.diffuse[2] * db[i] * diffuse;
+
+        if (shiny && diffuse > 0) {
+            double hx = lx, hy = ly, hz = lz + 1;
+            double length = sqrt(hx * hx + hy * hy + hz * hz);
+            double highlight = std::max(0.0, nx[i] * hx + ny[i] * hy + nz[i] * hz);
+            highlight = pow(length > 0 ? highlight / length : 0, material.shininess);
+            r[i] += specular[0] * highlight;
+            g[i] += specular[1] * highlight;
+            b[i] += specular[2] * highlight;
+        }
+    }
+}
+
+
+// The lighting stage: replaces the color of each vertex in the (untransformed)
+// batch with the color it is lit with, if lighting is on, given the matrices
+// that take its positions and normals into eye space. With
+// GL_COLOR_MATERIAL, the vertex color is the ambient and diffuse material.
+static void lightBatch(std::vector<PipelineVertex> &v, Matrix const &modelView, Matrix const &normals) {
+    if (!lightingEnabled) {
+        return;
+    }
+    TRACE_SCOPE("lighting");
+
+    int n = v.size();
+    lighting.px.resize(n); lighting.py.resize(n); lighting.pz.resize(n); lighting.pw.resize(n);
+    lighting.nx.resize(n); lighting.ny.resize(n); lighting.nz.resize(n);
+    lighting.ar.resize(n); lighting.ag.resize(n); lighting.ab.resize(n);
+    lighting.dr.resize(n); lighting.dg.resize(n); lighting.db.resize(n);
+    lighting.r.resize(n); lighting.g.resize(n); lighting.b.resize(n);
+
+    // Gather the batch into arrays.
+    for (int i = 0; i < n; i++) {
+        PipelineVertex const &p = v[i];
+        lighting.px[i] = p.position[0];
+        lighting.py[i] = p.position[1];
+        lighting.pz[i] = p.position[2];
+        lighting.pw[i] = p.position[3];
+        lighting.nx[i] = p.normal[0];
+        lighting.ny[i] = p.normal[1];
+        lighting.nz[i] = p.normal[2];
+        double color[3] = {p.color[0], p.color[1], p.color[2]};
+        double const *ambient = colorMaterialEnabled ? color : material.ambient;
+        double const *diffuse = colorMaterialEnabled ? color : material.diffuse;
+        lighting.ar[i] = ambient[0];
+        lighting.ag[i] = ambient[1];
+        lighting.ab[i] = ambient[2];
+        lighting.dr[i] = diffuse[0];
+        lighting.dg[i] = diffuse[1];
+        lighting.db[i] = diffuse[2];
+    }
+
+    // Move everything into eye space, where the lights are, and make the
+    // normals unit length.
+    transformArrays(modelView, &lighting.pw[0], &lighting.px[0], &lighting.py[0], &lighting.pz[0], n);
+    transformArrays(normals, NULL, &lighting.nx[0], &lighting.ny[0], &lighting.nz[0], n);
+    double *nx = &lighting.nx[0], *ny = &lighting.ny[0], *nz = &lighting.nz[0];
+    for (int i = 0; i < n; i++) {
+        double length = sqrt(nx[i] * nx[i] + ny[i] * ny[i] + nz[i] * nz[i]);
+        double scale = length > 0 ? 1 / length : 0;
+        nx[i] *= scale;
+        ny[i] *= scale;
+        nz[i] *= scale;
+    }
+
+    // Start from the emission and the scene's ambient light, then add each
+    // light.
+    for (int i = 0; i < n; i++) {
+        lighting.r[i] = material.emission[0] + sceneAmbient[0] * lighting.ar[i];
+        lighting.g[i] = material.emission[1] + sceneAmbient[1] * lighting.ag[i];
+        lighting.b[i] = material.emission[2] + sceneAmbient[2] * lighting.ab[i];
+    }
+    for (int i = 0; i < maxLights; i++) {
+        if (lights[i].enabled) {
+            addLight(lights[i], n);
+        }
+    }
+
+    // Scatter the colors back, clamped as OpenGL does.
+    for (int i = 0; i < n; i++) {
+        v[i].color = Vector(
+            std::min(1.0, lighting.r[i]),
+            std::min(1.0, lighting.g[i]),
+            std::min(1.0, lighting.b[i])
+        );
+    }
+}
+
+
+// The transform stage: moves the whole batch into clip coordinates. (Normals
+// are only needed by the lighting stage, which transforms its own.)
+static void transformBatch(std::vector<PipelineVertex> &v) {
+    TRACE_SCOPE("transform");
+    Matrix const &transform = modelViewProjection();
+    for (int i = 0; i < v.size(); i++) {
+        v[i].position = transform * v[i].position;
+    }
+    stats.verticesTransformed += v.size();
+}
+
+
+// The raster stage: assembles the batch into primitives of the given type,
+// then clips and draws them with the given pipeline variant.
+static void rasterBatch(PipelineVertex const *v, int n, int primitive, int features) {
+    TRACE_SCOPE("raster");
+
+    RasterPipeline const &pipeline =
+        features & RASTER_DEPTH_ONLY ? depthOnlyPipelines[!!(features & RASTER_MULTISAMPLE)] :
+        features & RASTER_VISIBILITY ? visibilityPipelines[!!(features & RASTER_MULTISAMPLE)] :
+        rasterPipelines[features];
+
+    // Draw only the vertices if asked to.
+    if (drawAsPoints || primitive == GL_POINTS) {
+        pipeline.points(v, n);
+        return;
+    }
+
+    switch (primitive) {
+        case GL_LINES:
+            for (int i = 1; i < n; i += 2) {
+                pipeline.line(v[i - 1], v[i]);
+            }
+            break;
+        case GL_LINE_STRIP:
+        case GL_LINE_LOOP:
+            for (int i = 1; i < n; i++) {
+                pipeline.line(v[i - 1], v[i]);
+            }
+            if (primitive == GL_LINE_LOOP && n > 2) {
+                pipeline.line(v[n - 1], v[0]);
+            }
+            break;
+        case GL_TRIANGLES:
+            for (int i = 2; i < n; i += 3) {
+                pipeline.triangle(v[i - 2], v[i - 1], v[i]);
+            }
+            break;
+        case GL_TRIANGLE_STRIP:
+            for (int i = 2; i < n; i++) {
+                pipeline.triangle(v[i - 2], v[i - 1], v[i]);
+            }
+            break;
+        case GL_QUADS:
+            for (int i = 3; i < n; i += 4) {
+                pipeline.polygon(&v[i - 3], 4);
+            }
+            break;
+        case GL_TRIANGLE_FAN:
+            for (int i = 2; i < n; i++) {
+                pipeline.triangle(v[0], v[i - 1], v[i]);
+            }
+            break;
+        case GL_POLYGON:
+            // Convex polygons are drawn whole.
+            if (n >= 3) {
+                pipeline.polygon(v, n);
+            }
+            break;
+        default:
+            std::cerr << "unsupported primitive type " << primitive << std::endl;
+            break;
+    }
+}
+
+
+// Hands a transformed batch of the current primitive type to the raster
+// stage, or queues it.
+static void submitBatch(std::vector<PipelineVertex> const &v) {
+    int n = v.size();
+    int features = rasterFeatures(n ? &v[0] : NULL, n);
+    if (!queueingDraws) {
+        rasterBatch(n ? &v[0] : NULL, n, currentPrimitive, features);
+        return;
+    }
+
+    // Bucket the batch by the depth of its nearest vertex in front of the
+    // eye (in normalized device coordinates, from -1 to 1).
+    double nearest = 1;
+    for (int i = 0; i < n; i++) {
+        if (v[i].position[3] > nearW) {
+            nearest = std::min(nearest, v[i].position[2] / v[i].position[3]);
+        }
+    }
+    QueuedBatch batch;
+    batch.first = queuedVertices.size();
+    batch.count = n;
+    batch.primitive = currentPrimitive;
+    batch.texture = currentTexture;
+    batch.features = features;
+    batch.depth = nearest;
+    batch.depthBucket = std::max(0, std::min(depthBuckets - 1, int((nearest + 1) / 2 * depthBuckets)));
+    drawQueue.push_back(batch);
+    queuedVertices.insert(queuedVertices.end(), v.begin(), v.end());
+}
+
+
+// Does a batch of the given type draw triangles (unless drawing points)?
+static bool isTrianglePrimitive(int primitive) {
+    return primitive == GL_TRIANGLES || primitive == GL_TRIANGLE_STRIP ||
+           primitive == GL_TRIANGLE_FAN || primitive == GL_QUADS || primitive == GL_POLYGON;
+}
+
+
+// Finds the color of a visible triangle at the given point (in pixels), from
+// its barycentric coordinates there. Counts any texel looked up in samples.
+static Vector shadeVisible(VisibleTriangle const &t, double x, double y, long &samples) {
+    Vector const &pa = t.a.position, &pb = t.b.position, &pc = t.c.position;
+    double area = edgeFunction(pa[0], pa[1], pb[0], pb[1], pc[0], pc[1]);
+    double l0 = edgeFunction(pb[0], pb[1], pc[0], pc[1], x, y) / area;
+    double l1 = edgeFunction(pc[0], pc[1], pa[0], pa[1], x, y) / area;
+    double l2 = 1.0 - l0 - l1;
+
+    if (t.features & RASTER_TEXTURED) {
+        // As in rasterTriangle(), perspective correct coordinates come from
+        // u/w and v/w divided by 1/w (in w, once projected).
+        double w0 = 1, w1 = 1, w2 = 1;
+        if (t.features & RASTER_PERSPECTIVE) {
+            w0 = pa[3];
+            w1 = pb[3];
+            w2 = pc[3];
+        }
+        double w = 1.0 / (l0 * w0 + l1 * w1 + l2 * w2);
+        double u = (l0 * t.a.texCoord[0] * w0 + l1 * t.b.texCoord[0] * w1 + l2 * t.c.texCoord[0] * w2) * w;
+        double v = (l0 * t.a.texCoord[1] * w0 + l1 * t.b.texCoord[1] * w1 + l2 * t.c.texCoord[1] * w2) * w;
+        samples++;
+        return t.texture->lookup(u, v);
+    } else if (t.features & RASTER_SMOOTH) {
+        return t.a.color * l0 + t.b.color * l1 + t.c.color * l2;
+    }
+    return t.a.color;
+}
+
+
+// Shades each pixel of the visibility buffer with the triangle seen there,
+// once, finding its attributes from barycentric coordinates at the pixel.
+// When multisampling, each triangle seen by any of a pixel's samples is
+// shaded once, and its color given to those samples. Like centroid sampling,
+// a triangle covering only some of the samples is shaded at the first of
+// them rather than the pixel's center, which may be outside it (where its
+// texture coordinates and colors would be extrapolated). Rows are shaded in
+// parallel, on the thread pool.
+static void shadeVisibilityBuffer() {
+
+    TRACE_SCOPE("shade visibility buffer");
+
+    int const grain = 16;
+    int chunks = parallelChunkCount(virtualHeight, grain);
+    std::vector<long> shaded(chunks, 0), samples(chunks, 0);
+
+    parallelForPooled(virtualHeight, grain, [&](int chunk, int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            for (int x = 0; x < virtualWidth; x++) {
+                if (!multisampling) {
+                    int id = visibilityBuffer[y * virtualWidth + x];
+                    if (id >= 0) {
+                        shaded[chunk]++;
+                        Vector color = shadeVisible(visibleTriangles[id], x, y, samples[chunk]);
+                        setPixel(x, y, color[0], color[1], color[2]);
+                    }
+                    continue;
+                }
+
+                int const *ids = &visibilityBuffer[samplesPerPixel * (y * virtualWidth + x)];
+                unsigned char *colors = sampleBuffer.color(x, y);
+                for (int s = 0; s < samplesPerPixel; s++) {
+                    if (ids[s] < 0) {
+                        continue;
+                    }
+                    // Reuse the color of an earlier sample of the same
+                    // triangle.
+                    int same = 0;
+                    while (ids[same] != ids[s]) {
+                        same++;
+                    }
+                    if (same == s) {
+                        bool whole = s == 0;
+                        for (int i = 1; whole && i < samplesPerPixel; i++) {
+                            whole = ids[i] == ids[0];
+                        }
+                        double sx = whole ? x : x + sampleOffsets[s][0];
+                        double sy = whole ? y : y + sampleOffsets[s][1];
+                        shaded[chunk]++;
+                        Vector color = shadeVisible(visibleTriangles[ids[s]], sx, sy, samples[chunk]);
+                        for (int i = 0; i < 3; i++) {
+                            colors[3 * s + i] = colorByte(color[i]);
+                        }
+                    } else {
+                        std::memcpy(colors + 3 * s, colors + 3 * same, 3);
+                    }
+                }
+            }
+        }
+    });
+
+    for (int c = 0; c < chunks; c++) {
+        stats.fragmentsShaded += shaded[c];
+        stats.textureSamples += samples[c];
+    }
+}
+
+
+void myBeginQueue(int mode) {
+    queueingDraws = true;
+    queueMode = mode;
+}
+
+
+void myFlushQueue() {
+
+    TRACE_SCOPE("myFlushQueue");
+    queueingDraws = false;
+    double start = now();
+
+    // Strictly front to back, or grouped by texture and pipeline variant and
+    // then (roughly) front to back; equal keys keep the order they were
+    // given in.
+    if (queueMode == MYGL_QUEUE_FRONT_TO_BACK) {
+        std::stable_sort(drawQueue.begin(), drawQueue.end(), [](QueuedBatch const &a, QueuedBatch const &b) {
+            return a.depth < b.depth;
+        });
+    } else {
+        std::stable_sort(drawQueue.begin(), drawQueue.end(), [](QueuedBatch const &a, QueuedBatch const &b) {
+            if (a.texture != b.texture) {
+                return std::less<Image*>()(a.texture, b.texture);
+            }
+            if (a.features != b.features) {
+                return a.features < b.features;
+            }
+            return a.depthBucket < b.depthBucket;
+        });
+    }
+
+    // With a prepass, the depth buffer ends up holding the nearest depths
+    // before anything is shaded, so that only the fragments that will be
+    // seen pass when it is.
+    if (queueMode == MYGL_QUEUE_DEPTH_PREPASS) {
+        TRACE_SCOPE("depth prepass");
+        for (int i = 0; i < drawQueue.size(); i++) {
+            QueuedBatch const &batch = drawQueue[i];
+            rasterBatch(&queuedVertices[batch.first], batch.count, batch.primitive,
+                        RASTER_DEPTH_ONLY | (batch.features & RASTER_MULTISAMPLE));
+        }
+    }
+
+    Image *texture = currentTexture;
+
+    // With a visibility buffer, triangles only leave their IDs where they
+    // are seen, and each pixel is shaded afterwards. (Points and lines are
+    // then drawn as usual, against the triangles' depths.)
+    bool visibility = queueMode == MYGL_QUEUE_VISIBILITY && !drawAsPoints;
+    if (visibility) {
+        TRACE_SCOPE("visibility pass");
+        visibilityBuffer.assign((multisampling ? samplesPerPixel : 1) * virtualWidth * virtualHeight, -1);
+        visibleTriangles.clear();
+        for (int i = 0; i < drawQueue.size(); i++) {
+            QueuedBatch const &batch = drawQueue[i];
+            if (isTrianglePrimitive(batch.primitive)) {
+                currentTexture = batch.texture;
+                visibilityFeatures = batch.features;
+                rasterBatch(&queuedVertices[batch.first], batch.count, batch.primitive,
+                            RASTER_VISIBILITY | (batch.features & RASTER_MULTISAMPLE));
+            }
+        }
+        shadeVisibilityBuffer();
+    }
+
+    for (int i = 0; i < drawQueue.size(); i++) {
+        QueuedBatch const &batch = drawQueue[i];
+        if (visibility && isTrianglePrimitive(batch.primitive)) {
+            continue;
+        }
+        currentTexture = batch.texture;
+        rasterBatch(&queuedVertices[batch.first], batch.count, batch.primitive, batch.features);
+    }
+    currentTexture = texture;
+
+    drawQueue.clear();
+    queuedVertices.clear();
+    stats.rasterTime += now() - start;
+}
+
+
+void myEnd() {
+    if (recordingList) {
+        recorder.endPending = true;
+        return;
+    }
+
+    double start = now();
+    lightBatch(vertexBatch, modelViewMatrix, normalTransform());
+    transformBatch(vertexBatch);
+    double transformed = now();
+    submitBatch(vertexBatch);
+    stats.transformTime += transformed - start;
+    stats.rasterTime += now() - transformed;
+
+    vertexBatch.clear();
+}
+
+
+// Could any of the given box be seen, once multiplied by the given matrix into
+// clip coordinates? Each bit of a corner's outcode says it is outside one of
+// the planes primitives are clipped to (-w <= x, y <= w, and the near plane);
+// if every corner shares a bit, the whole box is outside that plane.
+static bool boxIsVisible(Matrix const &transform, double const *min, double const *max) {
+    int shared = 31;
+    for (int i = 0; i < 8; i++) {
+        Vector p = transform * Vector(i & 1 ? max[0] : min[0], i & 2 ? max[1] : min[1], i & 4 ? max[2] : min[2], 1);
+        int outcode = (p[0] < -p[3]) | (p[0] > p[3]) << 1 |
+                      (p[1] < -p[3]) << 2 | (p[1] > p[3]) << 3 |
+                      (p[3] < nearW) << 4;
+        shared &= outcode;
+        if (!shared) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Scratch space for instancing: the batch's positions in model space, and
+// one instance's positions in clip space, as arrays (as for lighting).
+static struct {
+    std::vector<double> x, y, z, w;
+    std::vector<double> cx, cy, cz, cw;
+} instancing;
+
+// One instance of the batch, as it goes down the pipeline.
+static std::vector<PipelineVertex> instanceBatch;
+
+
+// Records myDrawInstanced() into the display list. The batch's vertices
+// were recorded with the list's transformations (T) already applied, so each
+// instance's matrix (M) is recorded as T M T^-1, which takes them to T M v.
+// That also holds for normals, as (T M T^-1)^-T T^-T = T^-T M^-T.
+static void recordInstances(Matrix const *transforms, int count) {
+
+    // A batch merged into the one before it must be split off again, or
+    // that one would be instanced too.
+    if (recorder.merged) {
+        unsigned char split[1 + 1 + sizeof(int)] = {LIST_END, LIST_BEGIN};
+        memcpy(&split[2], &recorder.primitive, sizeof(int));
+        recordingList->insert(recorder.batchStart, split, sizeof(split));
+        recorder.merged = false;
+    }
+    recorder.endPending = false;
+
+    Matrix inverse = recorder.transform.inverse();
+    recordingList->op(LIST_END_INSTANCED);
+    recordingList->operand(count);
+    for (int i = 0; i < count; i++) {
+        Matrix m = recorder.transform * transforms[i] * inverse;
+        for (int r = 0; r < 4; r++) {
+            for (int c = 0; c < 4; c++) {
+                recordingList->operand(m[r][c]);
+            }
+        }
+    }
+}
+
+
+void myDrawInstanced(Matrix const *transforms, int count) {
+    if (recordingList) {
+        recordInstances(transforms, count);
+        return;
+    }
+    TRACE_SCOPE("myDrawInstanced");
+
+    // Gather the batch's positions, and their bounds for culling (unless a
+    // position is at or beyond infinity, with w not above 0, as a list's
+    // transformations may leave it).
+    int n = vertexBatch.size();
+    double min[3] = {DBL_MAX, DBL_MAX, DBL_MAX};
+    double max[3] = {-DBL_MAX, -DBL_MAX, -DBL_MAX};
+    bool bounded = true;
+    instancing.x.resize(n); instancing.y.resize(n); instancing.z.resize(n); instancing.w.resize(n);
+    instancing.cx.resize(n); instancing.cy.resize(n); instancing.cz.resize(n); instancing.cw.resize(n);
+    for (int i = 0; i < n; i++) {
+        Vector const &p = vertexBatch[i].position;
+        bounded = bounded && p[3] > 0;
+        for (int j = 0; bounded && j < 3; j++) {
+            min[j] = std::min(min[j], p[j] / p[3]);
+            max[j] = std::max(max[j], p[j] / p[3]);
+        }
+        instancing.x[i] = p[0];
+        instancing.y[i] = p[1];
+        instancing.z[i] = p[2];
+        instancing.w[i] = p[3];
+    }
+    double const *x = &instancing.x[0], *y = &instancing.y[0], *z = &instancing.z[0], *w = &instancing.w[0];
+    double *cx = &instancing.cx[0], *cy = &instancing.cy[0], *cz = &instancing.cz[0], *cw = &instancing.cw[0];
+
+    for (int k = 0; n && k < count; k++) {
+        double start = now();
+        Matrix m = modelViewProjection() * transforms[k];
+        if (bounded && !boxIsVisible(m, min, max)) {
+            stats.instancesCulled++;
+            continue;
+        }
+
+        instanceBatch = vertexBatch;
+        if (lightingEnabled) {
+            Matrix modelView = modelViewMatrix * transforms[k];
+            lightBatch(instanceBatch, modelView, modelView.inverse().transpose());
+        }
+
+        // Take the instance into clip coordinates with one matrix, as plain
+        // loops over arrays.
+        {
+            TRACE_SCOPE("transform");
+            double m00 = m[0][0], m01 = m[0][1], m02 = m[0][2], m03 = m[0][3];
+            double m10 = m[1][0], m11 = m[1][1], m12 = m[1][2], m13 = m[1][3];
+            double m20 = m[2][0], m21 = m[2][1], m22 = m[2][2], m23 = m[2][3];
+            double m30 = m[3][0], m31 = m[3][1], m32 = m[3][2], m33 = m[3][3];
+            for (int i = 0; i < n; i++) {
+                cx[i] = m00 * x[i] + m01 * y[i] + m02 * z[i] + m03 * w[i];
+                cy[i] = m10 * x[i] + m11 * y[i] + m12 * z[i] + m13 * w[i];
+                cz[i] = m20 * x[i] + m21 * y[i] + m22 * z[i] + m23 * w[i];
+                cw[i] = m30 * x[i] + m31 * y[i] + m32 * z[i] + m33 * w[i];
+            }
+            for (int i = 0; i < n; i++) {
+                instanceBatch[i].position = Vector(cx[i], cy[i], cz[i], cw[i]);
+            }
+            stats.verticesTransformed += n;
+        }
+
+        double transformed = now();
+        submitBatch(instanceBatch);
+        stats.transformTime += transformed - start;
+        stats.rasterTime += now() - transformed;
+    }
+
+    vertexBatch.clear();
+}
+
+
+void myDrawPoints(Vector const *positions, Vector const *colors, int count) {
+    if (recordingList) {
+        // Only the arrays are referred to, along with the transform so far.
+        flushPendingEnd();
+        recordingList->op(LIST_DRAW_POINTS);
+        recordingList->operand(positions);
+        recordingList->operand(colors);
+        recordingList->operand(count);
+        for (int r = 0; r < 4; r++) {
+            for (int c = 0; c < 4; c++) {
+                recordingList->operand(recorder.transform[r][c]);
+            }
+        }
+        return;
+    }
+    TRACE_SCOPE("myDrawPoints");
+    double start = now();
+    stats.verticesSubmitted += count;
+    stats.verticesTransformed += count;
+
+    Matrix const &m = modelViewProjection();
+    double m00 = m[0][0], m01 = m[0][1], m02 = m[0][2], m03 = m[0][3];
+    double m10 = m[1][0], m11 = m[1][1], m12 = m[1][2], m13 = m[1][3];
+    double m20 = m[2][0], m21 = m[2][1], m22 = m[2][2], m23 = m[2][3];
+    double m30 = m[3][0], m31 = m[3][1], m32 = m[3][2], m33 = m[3][3];
+    unsigned color = packColor(currentColor);
+    double zSign = projectionIsPerspective ? 1 : -1;
+
+    // Each block is taken into clip coordinates a coordinate at a time, and
+    // then projected as project() would.
+    auto projectBlock = [&](int begin, int end, Splat *splats) {
+        double cx[splatBlock], cy[splatBlock], cz[splatBlock], cw[splatBlock];
+        int n = end - begin;
+        Vector const *p = positions + begin;
+        for (int i = 0; i < n; i++) {
+            cx[i] = m00 * p[i][0] + m01 * p[i][1] + m02 * p[i][2] + m03;
+            cy[i] = m10 * p[i][0] + m11 * p[i][1] + m12 * p[i][2] + m13;
+            cz[i] = m20 * p[i][0] + m21 * p[i][1] + m22 * p[i][2] + m23;
+            cw[i] = m30 * p[i][0] + m31 * p[i][1] + m32 * p[i][2] + m33;
+        }
+        int landed = 0;
+        for (int i = 0; i < n; i++) {
+            if (cw[i] < nearW) {
+                continue;
+            }
+            double invW = 1.0 / cw[i];
+            int x = int(floor((cx[i] * invW + 1.0) * 0.5 * virtualWidth));
+            int y = int(floor((cy[i] * invW + 1.0) * 0.5 * virtualHeight));
+            if (x < 0 || x >= virtualWidth || y < 0 || y >= virtualHeight) {
+                continue;
+            }
+            Splat &splat = splats[landed++];
+            splat.pixel = y * virtualWidth + x;
+            splat.depth = float(cz[i] * invW * zSign);
+            splat.color = colors ? packColor(colors[begin + i]) : color;
+        }
+        return landed;
+    };
+
+    if (multisampling) {
+        splatPoints<RASTER_MULTISAMPLE>(count, projectBlock);
+    } else {
+        splatPoints<0>(count, projectBlock);
+    }
+    stats.rasterTime += now() - start;
+}
+
+
+static void setTexture(Image *texture) {
+    if (recordingList) {
+        if (recorder.hasTexture && recorder.texture == texture) {
+            return;
+        }
+        flushPendingEnd();
+        recordingList->op(LIST_TEXTURE);
+        recordingList->operand(texture);
+        recorder.texture = texture;
+        recorder.hasTexture = true;
+    } else {
+        currentTexture = texture;
+    }
+}
+
+
+static void multModelView(Matrix const &m) {
+    if (recordingList) {
+        recorder.transform *= m;
+        recorder.normalTransformIsDirty = true;
+    } else {
+        modelViewMatrix *= m;
+        modelViewChanged();
+    }
+}
+
+
+static Matrix const &currentModelView() {
+    return recordingList ? recorder.transform : modelViewMatrix;
+}
+
+
+static void restoreModelView(Matrix const &m) {
+    if (recordingList) {
+        recorder.transform = m;
+        recorder.normalTransformIsDirty = true;
+    } else {
+        modelViewMatrix = m;
+        modelViewChanged();
+    }
+}
+
+
+void myPushMatrix() {
+    Matrix *stack = recordingList ? recorder.stack : modelViewStack;
+    int &depth = recordingList ? recorder.stackDepth : modelViewStackDepth;
+    if (depth == maxStackDepth) {
+        std::cerr << "myPushMatrix: stack overflow" << std::endl;
+        return;
+    }
+    stack[depth++] = recordingList ? recorder.transform : modelViewMatrix;
+}
+
+
+void myPopMatrix() {
+    Matrix *stack = recordingList ? recorder.stack : modelViewStack;
+    int &depth = recordingList ? recorder.stackDepth : modelViewStackDepth;
+    if (depth == 0) {
+        std::cerr << "myPopMatrix: stack underflow" << std::endl;
+        return;
+    }
+    if (recordingList) {
+        recorder.transform = stack[--depth];
+        recorder.normalTransformIsDirty = true;
+    } else {
+        modelViewMatrix = stack[--depth];
+        modelViewChanged();
+    }
+}
+
+
+void myTranslate(double tx, double ty, double tz) {
+    multModelView(Matrix(
+        1, 0, 0, tx,
+        0, 1, 0, ty,
+        0, 0, 1, tz,
+        0, 0, 0, 1
+    ));
+}
+
+
+void myRotate(double angle, double axisX, double axisY, double axisZ) {
+    Vector axis = Vector(axisX, axisY, axisZ).normalized();
+    multModelView(Matrix::rotation(angle * M_PI / 180.0, axis));
+}
+
+
+void myScale(double sx, double sy, double sz) {
+    multModelView(Matrix(
+        sx, 0,  0,  0,
+        0,  sy, 0,  0,
+        0,  0,  sz, 0,
+        0,  0,  0,  1
+    ));
+}
+
+
+void myFrustum(double left, double right, double bottom, double top, double near, double far) {
+    projectionMatrix *= Matrix(
+        2 * near / (right - left), 0, (right + left) / (right - left), 0,
+        0, 2 * near / (top - bottom), (top + bottom) / (top - bottom), 0,
+        0, 0, -(far + near) / (far - near), -2 * far * near / (far - near),
+        0, 0, -1, 0
+    );
+    projectionChanged();
+}
+
+
+void myLookAt(double eyeX, double eyeY, double eyeZ,
+              double cenX, double cenY, double cenZ,
+              double  upX, double  upY, double  upZ) {
+
+    // Build an orthonormal basis for the camera.
+    Vector forward = Vector(cenX - eyeX, cenY - eyeY, cenZ - eyeZ).normalized();
+    Vector side = forward.cross(Vector(upX, upY, upZ)).normalized();
+    Vector up = side.cross(forward);
+
+    // Rotate into that basis, after moving the eye to the origin.
+    modelViewMatrix *= Matrix(
+         side[0],     side[1],     side[2],    0,
+         up[0],       up[1],       up[2],      0,
+        -forward[0], -forward[1], -forward[2], 0,
+         0,           0,           0,          1
+    );
+    modelViewMatrix *= Matrix(
+        1, 0, 0, -eyeX,
+        0, 1, 0, -eyeY,
+        0, 0, 1, -eyeZ,
+        0, 0, 0, 1
+    );
+    modelViewChanged();
+}
+
+
+// What the model-view matrix would be where the caller is: if a list is being
+// recorded, with its transformations so far (as they are when it is called).
+static Matrix effectiveModelView() {
+    Matrix modelView = modelViewMatrix;
+    if (recordingList) {
+        modelView *= recorder.transform;
+    }
+    return modelView;
+}
+
+
+double myProjectedSize(double x, double y, double z, double radius) {
+
+    Matrix modelView = effectiveModelView();
+    Vector center = modelView * Vector(x, y, z, 1);
+
+    // Scale the radius by the largest scale in the model-view matrix, then
+    // by the projection (which maps 2 units onto the virtual window).
+    double scale = 0;
+    for (int c = 0; c < 3; c++) {
+        scale = std::max(scale, Vector(modelView[0][c], modelView[1][c], modelView[2][c]).length());
+    }
+    double size = radius * scale * fabs(projectionMatrix[1][1]) * virtualHeight;
+    if (projectionIsPerspective) {
+        double w = projectionMatrix[3].dot(center, true);
+        if (w <= 0) {
+            return 0;
+        }
+        size /= w;
+    }
+    return size;
+}
+
+
+bool myIsBoxVisible(double minX, double minY, double minZ,
+                    double maxX, double maxY, double maxZ) {
+
+    Matrix transform = recordingList ? projectionMatrix * effectiveModelView() : modelViewProjection();
+    double min[3] = {minX, minY, minZ};
+    double max[3] = {maxX, maxY, maxZ};
+    return boxIsVisible(transform, min, max);
+}
+
+
+Vector myEyePosition() {
+    Vector eye = effectiveModelView().inverse() * Vector(0, 0, 0, 1);
+    return eye / eye[3];
+}
+
+
+void myTexCoord(double s, double t) {
+    if (recordingList) {
+        double values[2] = {s, t};
+        recordState(LIST_TEX_COORD, 2, recorder.texCoord, recorder.hasTexCoord, values);
+        return;
+    }
+    currentTextureCoord[0] = s;
+    currentTextureCoord[1] = t;
+}
+
+
+void myNormal(double x, double y, double z) {
+    if (recordingList) {
+        if (recorder.normalTransformIsDirty) {
+            recorder.normalTransform = recorder.transform.inverse().transpose();
+            recorder.normalTransformIsDirty = false;
+        }
+        Vector n = (recorder.normalTransform * Vector(x, y, z, 0)).normalized();
+        double values[3] = {n[0], n[1], n[2]};
+        recordState(LIST_NORMAL, 3, recorder.normal, recorder.hasNormal, values);
+        return;
+    }
+    currentNormal = Vector(x, y, z);
+}
+
+
+// The light a GL_LIGHTi enum refers to, or NULL (with a complaint).
+static Light *findLight(int light, char const *caller) {
+    int index = light - GL_LIGHT0;
+    if (index < 0 || index >= maxLights) {
+        std::cerr << caller << ": unknown light " << light << std::endl;
+        return NULL;
+    }
+    return &lights[index];
+}
+
+
+// Turns a capability on or off, or records doing so.
+static void setCapability(int capability, bool value) {
+    if (recordingList) {
+        flushPendingEnd();
+        recordingList->op(value ? LIST_ENABLE : LIST_DISABLE);
+        recordingList->operand(capability);
+        return;
+    }
+    if (capability == GL_LIGHTING) {
+        lightingEnabled = value;
+    } else if (capability == GL_COLOR_MATERIAL) {
+        colorMaterialEnabled = value;
+    } else if (Light *light = findLight(capability, "myEnable")) {
+        light->enabled = value;
+    }
+}
+
+
+void myEnable(int capability) {
+    setCapability(capability, true);
+}
+
+
+void myDisable(int capability) {
+    setCapability(capability, false);
+}
+
+
+void myLight(int light, int parameter, double x, double y, double z, double w) {
+    if (recordingList) {
+        if (parameter == GL_POSITION) {
+            Vector p = recorder.transform * Vector(x, y, z, w);
+            x = p[0];
+            y = p[1];
+            z = p[2];
+            w = p[3];
+        }
+        double values[4] = {x, y, z, w};
+        flushPendingEnd();
+        recordingList->op(LIST_LIGHT);
+        recordingList->operand(light);
+        recordingList->operand(parameter);
+        recordingList->operand(values);
+        return;
+    }
+    Light *l = findLight(light, "myLight");
+    if (!l) {
+        return;
+    }
+    double values[4] = {x, y, z, w};
+    switch (parameter) {
+        case GL_POSITION: {
+            // Lights are kept in eye space, so this is the only time the
+            // position needs transforming.
+            Vector p = modelViewMatrix * Vector(x, y, z, w);
+            for (int i = 0; i < 4; i++) {
+                l->position[i] = p[i];
+            }
+            break;
+        }
+        case GL_AMBIENT:
+            memcpy(l->ambient, values, sizeof(l->ambient));
+            break;
+        case GL_DIFFUSE:
+            memcpy(l->diffuse, values, sizeof(l->diffuse));
+            break;
+        case GL_SPECULAR:
+            memcpy(l->specular, values, sizeof(l->specular));
+            break;
+        default:
+            std::cerr << "myLight: unsupported parameter " << parameter << std::endl;
+            break;
+    }
+}
+
+
+void myMaterial(int parameter, double x, double y, double z, double w) {
+    if (recordingList) {
+        double values[4] = {x, y, z, w};
+        flushPendingEnd();
+        recordingList->op(LIST_MATERIAL);
+        recordingList->operand(parameter);
+        recordingList->operand(values);
+        return;
+    }
+    double values[3] = {x, y, z};
+    switch (parameter) {
+        case GL_AMBIENT:
+            memcpy(material.ambient, values, sizeof(values));
+            break;
+        case GL_DIFFUSE:
+            memcpy(material.diffuse, values, sizeof(values));
+            break;
+        case GL_AMBIENT_AND_DIFFUSE:
+            memcpy(material.ambient, values, sizeof(values));
+            memcpy(material.diffuse, values, sizeof(values));
+            break;
+        case GL_SPECULAR:
+            memcpy(material.specular, values, sizeof(values));
+            break;
+        case GL_EMISSION:
+            memcpy(material.emission, values, sizeof(values));
+            break;
+        case GL_SHININESS:
+            material.shininess = x;
+            break;
+        default:
+            std::cerr << "myMaterial: unsupported parameter " << parameter << std::endl;
+            break;
+    }
+}
+
+
+int myGenList() {
+    int name = nextListName++;
+    displayLists[name].clear();
+    return name;
+}
+
+
+void myNewList(int list) {
+    if (recordingList) {
+        std::cerr << "myNewList called while already recording a list" << std::endl;
+        return;
+    }
+    recordingList = &displayLists[list];
+    recordingList->clear();
+    recorder.transform = Matrix::identity();
+    recorder.stackDepth = 0;
+    recorder.normalTransformIsDirty = true;
+    recorder.hasColor = recorder.hasTexCoord = recorder.hasNormal = false;
+    recorder.hasTexture = false;
+    recorder.endPending = false;
+    recorder.merged = false;
+    recorder.vertices = 0;
+}
+
+
+void myEndList() {
+    if (!recordingList) {
+        std::cerr << "myEndList called without myNewList" << std::endl;
+        return;
+    }
+    flushPendingEnd();
+    if (recorder.stackDepth) {
+        std::cerr << "myEndList: unbalanced myPushMatrix in list" << std::endl;
+    }
+
+    // Leave the model-view matrix as it would have been had the commands
+    // been executed immediately.
+    Matrix const &m = recorder.transform;
+    bool identity = true;
+    for (int r = 0; r < 4; r++) {
+        for (int c = 0; c < 4; c++) {
+            identity = identity && m[r][c] == (r == c ? 1 : 0);
+        }
+    }
+    if (!identity) {
+        recordingList->op(LIST_MULT_MATRIX);
+        for (int r = 0; r < 4; r++) {
+            for (int c = 0; c < 4; c++) {
+                recordingList->operand(m[r][c]);
+            }
+        }
+    }
+
+    recordingList = NULL;
+}
+
+
+void myCallList(int list) {
+    std::map<int,DisplayList>::const_iterator it = displayLists.find(list);
+    if (it == displayLists.end()) {
+        return;
+    }
+    DisplayList const &dl = it->second;
+
+    // Replay through the public entry points, so that a list called while
+    // recording another one is folded into it.
+    size_t i = 0;
+    while (i < dl.size()) {
+        switch (dl.at(i++)) {
+            case LIST_BEGIN:
+                myBegin(dl.read<int>(i));
+                break;
+            case LIST_END:
+                myEnd();
+                break;
+            case LIST_END_INSTANCED: {
+                std::vector<Matrix> transforms(dl.read<int>(i));
+                for (int k = 0; k < transforms.size(); k++) {
+                    for (int r = 0; r < 4; r++) {
+                        for (int c = 0; c < 4; c++) {
+                            transforms[k][r][c] = dl.read<double>(i);
+                        }
+                    }
+                }
+                myDrawInstanced(transforms.empty() ? NULL : &transforms[0], transforms.size());
+                break;
+            }
+            case LIST_DRAW_POINTS: {
+                Vector const *positions = dl.read<Vector const*>(i);
+                Vector const *colors = dl.read<Vector const*>(i);
+                int count = dl.read<int>(i);
+                Matrix m;
+                for (int r = 0; r < 4; r++) {
+                    for (int c = 0; c < 4; c++) {
+                        m[r][c] = dl.read<double>(i);
+                    }
+                }
+                // Not with myPushMatrix, as the caller's stack may be full.
+                Matrix saved = currentModelView();
+                multModelView(m);
+                myDrawPoints(positions, colors, count);
+                restoreModelView(saved);
+                break;
+            }
+            case LIST_COLOR: {
+                double r = dl.read<double>(i);
+                double g = dl.read<double>(i);
+                double b = dl.read<double>(i);
+                myColor(r, g, b);
+                break;
+            }
+            case LIST_TEX_COORD: {
+                double s = dl.read<double>(i);
+                double t = dl.read<double>(i);
+                myTexCoord(s, t);
+                break;
+            }
+            case LIST_NORMAL: {
+                double x = dl.read<double>(i);
+                double y = dl.read<double>(i);
+                double z = dl.read<double>(i);
+                myNormal(x, y, z);
+                break;
+            }
+            case LIST_VERTEX: {
+                Vector p;
+                for (int j = 0; j < 4; j++) {
+                    p[j] = dl.read<double>(i);
+                }
+                addVertex(p);
+                break;
+            }
+            case LIST_TEXTURE:
+                setTexture(dl.read<Image*>(i));
+                break;
+            case LIST_MULT_MATRIX: {
+                Matrix m;
+                for (int r = 0; r < 4; r++) {
+                    for (int c = 0; c < 4; c++) {
+                        m[r][c] = dl.read<double>(i);
+                    }
+                }
+                multModelView(m);
+                break;
+            }
+            case LIST_ENABLE:
+                myEnable(dl.read<int>(i));
+                break;
+            case LIST_DISABLE:
+                myDisable(dl.read<int>(i));
+                break;
+            case LIST_LIGHT: {
+                int light = dl.read<int>(i);
+                int parameter = dl.read<int>(i);
+                double v[4];
+                for (int j = 0; j < 4; j++) {
+                    v[j] = dl.read<double>(i);
+                }
+                myLight(light, parameter, v[0], v[1], v[2], v[3]);
+                break;
+            }
+            case LIST_MATERIAL: {
+                int parameter = dl.read<int>(i);
+                double v[4];
+                for (int j = 0; j < 4; j++) {
+                    v[j] = dl.read<double>(i);
+                }
+                myMaterial(parameter, v[0], v[1], v[2], v[3]);
+                break;
+            }
+        }
+    }
+}
+
+
+void myDeleteList(int list) {
+    std::map<int,DisplayList>::iterator it = displayLists.find(list);
+    if (it == displayLists.end()) {
+        return;
+    }
+    if (recordingList == &it->second) {
+        std::cerr << "cannot delete the list being recorded" << std::endl;
+        return;
+    }
+    displayLists.erase(it);
+}
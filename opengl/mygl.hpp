@@ -5,22 +5,134 @@
 #include "linalg.hpp"
 
 
+// The number of virtual color buffers; see myDrawBuffer().
+#define MYGL_COLOR_BUFFERS 3
+
+
 // Counterpart to glViewport; sets up the virtual window.
 void myViewport(int width, int height);
 
-// Counterpart to glClear; clears the real color buffer and the virtual
-// depth buffer.
+// Counterpart to glDrawBuffer; selects which virtual color buffer (from 0 to
+// MYGL_COLOR_BUFFERS - 1) myClear() and drawing go into. A frame can be drawn
+// into one buffer while another is being shown.
+void myDrawBuffer(int buffer);
+
+// Counterpart to glClear; clears the current virtual color buffer and the
+// virtual depth buffer.
 void myClear();
 
+// When multisampling, drawing goes into four depth and color samples per
+// pixel instead of the color and depth buffers (though each primitive is still
+// shaded once per pixel); this averages them into the current virtual color
+// buffer, like glBlitFramebuffer from a multisampled framebuffer. Call it once
+// a frame is drawn. Does nothing when not multisampling.
+void myResolve();
+
+// Shows the given virtual color buffer in the real window, as a single
+// textured quad. A buffer is only uploaded again if a new frame was drawn
+// into it since it was last shown, so this is also how a frame is shown again
+// without redrawing it. Must be called from the thread owning the OpenGL
+// context, and never on the buffer being drawn into.
+void myPresent(int buffer);
+
+// Counterpart to glReadPixels; copies the given virtual color buffer into
+// pixels, as RGBA bytes with rows bottom to top, which must have room for the
+// whole virtual window it was drawn at.
+void myReadPixels(int buffer, unsigned char *pixels);
+
+// Draws the virtual pixel grid over the real window, lined up with the
+// buffer last given to myPresent().
+void drawPixelGrid();
+
+// Counters for the work done by the pipeline, as returned by myGetStats().
+struct MyStats {
+
+    // Vertices given to myVertex, and vertices run through the transform
+    // stage.
+    long verticesSubmitted;
+    long verticesTransformed;
+
+    // Primitives discarded entirely (behind the eye, off-screen, or with no
+    // area), and primitives that had to be cut down to what is visible.
+    long primitivesCulled;
+    long primitivesClipped;
+
+    // Pixels covered by primitives, and how many of those passed or failed
+    // the depth test.
+    long fragmentsGenerated;
+    long depthPasses;
+    long depthFails;
+
+    // Fragments given a color (i.e. that passed outside of a depth prepass),
+    // and pixels drawn to at all; how many times each pixel was shaded (the
+    // overdraw) is the ratio of the two.
+    long fragmentsShaded;
+    long pixelsCovered;
+
+    // Texels looked up.
+    long textureSamples;
+
+    // Copies given to myDrawInstanced() that were culled whole.
+    long instancesCulled;
+
+    // Milliseconds spent in the transform and raster stages.
+    double transformTime;
+    double rasterTime;
+
+    MyStats() :
+        verticesSubmitted(0), verticesTransformed(0),
+        primitivesCulled(0), primitivesClipped(0),
+        fragmentsGenerated(0), depthPasses(0), depthFails(0),
+        fragmentsShaded(0), pixelsCovered(0),
+        textureSamples(0),
+        instancesCulled(0),
+        transformTime(0), rasterTime(0)
+        {}
+
+};
+
+// Returns the counters for the work done since the last myClear().
+MyStats myGetStats();
+
+
 // Counterpart to glLoadIdentity; sets both projection and model-view matrix
 // to be the identity.
 void myLoadIdentity();
 
 // Counterpart to glBindTexture; sets the current texture to that contained
-// within the given file name. Pass NULL to turn off textures.
+// within the given file name. Pass NULL to turn off textures. Textured
+// primitives take their color from the texture alone (as with GL_REPLACE),
+// so vertex colors, and lighting, do not affect them.
 void myBindTexture(char const *name);
 
-// EVERYTHING BELOW THIS LINE IS FOR YOU TO IMPLEMENT
+// How myFlushQueue() orders queued draws.
+enum MyQueueMode {
+    // Sorted by texture, then by which raster variant they need, then
+    // roughly front to back, so that each texture and variant is switched
+    // to once.
+    MYGL_QUEUE_STATE_SORTED,
+    // Sorted strictly front to back (by their nearest vertex), so that as
+    // many fragments as possible fail the depth test before being shaded.
+    MYGL_QUEUE_FRONT_TO_BACK,
+    // State sorted, but first drawn once into only the depth buffer, so
+    // that only the fragments that will be seen are shaded.
+    MYGL_QUEUE_DEPTH_PREPASS,
+    // Triangles are drawn into a visibility buffer (depth, and the ID of
+    // the triangle seen at each pixel), which is then shaded once per pixel
+    // (in parallel), so that shading costs as much as the window is large,
+    // however many triangles are drawn. Texture coordinates are always
+    // found exactly, even with perspectiveSpanLength.
+    MYGL_QUEUE_VISIBILITY
+};
+
+// Starts queueing draws: from here on, myEnd() (and myDrawInstanced) only
+// light and transform primitives, and leave drawing them to myFlushQueue().
+void myBeginQueue(int mode=MYGL_QUEUE_STATE_SORTED);
+
+// Draws everything queued since myBeginQueue() as its mode says, and stops
+// queueing. (As depth testing uses LEQUAL, only primitives at exactly the
+// same depth can come out differently than if drawn in order.)
+void myFlushQueue();
 
 // Counterpart to glBegin; tells the system what primitives we will be
 // drawing.
@@ -37,6 +149,23 @@ void myVertex(double x, double y, double z);
 // last myBegin().
 void myEnd();
 
+// Used instead of myEnd(), like glDrawArraysInstanced; draws count copies of
+// the primitives specified since the last myBegin(), each with its positions
+// and normals first multiplied by its own matrix from transforms. The vertices
+// are only given once, and copies whose bounding box cannot be seen (see
+// myIsBoxVisible) are skipped.
+void myDrawInstanced(Matrix const *transforms, int count);
+
+// Like glDrawArrays with GL_POINTS: draws count points at the given positions
+// (in object coordinates) in the given colors, or the current color if colors
+// is NULL, unlit and untextured. Points are projected a block at a time, and
+// splatted on several threads at once, so this is the way to draw large point
+// clouds. They are drawn straight away, even while draws are being queued.
+// A display list only records where the arrays are, so they must outlive it.
+// Points (however they are drawn) are depth tested with their depth rounded
+// to a float.
+void myDrawPoints(Vector const *positions, Vector const *colors, int count);
+
 // Counterpart to glTranslated; multiplies the model-view matrix by the given
 // translation.
 void myTranslate(double tx, double ty, double tz);
@@ -49,6 +178,14 @@ void myRotate(double angle, double axisX, double axisY, double axisZ);
 // non-uniform scale.
 void myScale(double sx, double sy, double sz);
 
+// Counterpart to glPushMatrix; saves a copy of the model-view matrix on a
+// stack (up to 32 deep).
+void myPushMatrix();
+
+// Counterpart to glPopMatrix; restores the last model-view matrix saved by
+// myPushMatrix().
+void myPopMatrix();
+
 // Counterpart to glFrustum; multiplies projection matrix with a
 // transformation to use the given frustrum.
 void myFrustum(double left, double right, double bottom, double top, double near, double far);
@@ -59,6 +196,20 @@ void myLookAt(double eyeX, double eyeY, double eyeZ,
               double cenX, double cenY, double cenZ,
               double  upX, double  upY, double  upZ);
 
+// Returns roughly how many virtual pixels across a sphere of the given radius,
+// centered on the given point (in object coordinates), would appear with the
+// current matrices; or 0 if its center is behind the eye. Useful for picking
+// a level of detail.
+double myProjectedSize(double x, double y, double z, double radius);
+
+// Could any of the given box (in object coordinates) be seen with the current
+// matrices? Boxes entirely outside one side of the view volume cannot.
+bool myIsBoxVisible(double minX, double minY, double minZ,
+                    double maxX, double maxY, double maxZ);
+
+// Returns where the eye is in object coordinates (w is 1).
+Vector myEyePosition();
+
 
 // Counterpart to glTexCoord2d; sets current texture coordinates.
 void myTexCoord(double s, double t);
@@ -67,4 +218,45 @@ void myTexCoord(double s, double t);
 void myNormal(double x, double y, double z);
 
 
+// Counterparts to glEnable/glDisable, for GL_LIGHTING, GL_LIGHT0 through
+// GL_LIGHT7, and GL_COLOR_MATERIAL (with which the current color is used as
+// both the ambient and diffuse material).
+void myEnable(int capability);
+void myDisable(int capability);
+
+// Counterpart to glLight for GL_POSITION, GL_AMBIENT, GL_DIFFUSE and
+// GL_SPECULAR. As with glLight, a position (or direction, if w is 0) is taken
+// into eye space by the model-view matrix when it is given, so set it once
+// per frame after the camera.
+void myLight(int light, int parameter, double x, double y, double z, double w);
+
+// Counterpart to glMaterial (for both faces) for GL_AMBIENT, GL_DIFFUSE,
+// GL_AMBIENT_AND_DIFFUSE, GL_SPECULAR, GL_EMISSION and GL_SHININESS (which
+// only uses x). Lit vertices are shaded per vertex with Blinn-Phong
+// highlights, and interpolated across primitives (Gouraud shading). Lighting
+// only colors untextured primitives; see myBindTexture.
+void myMaterial(int parameter, double x, double y, double z, double w);
+
+
+// Counterpart to glGenLists; returns the name of a new, empty display list.
+int myGenList();
+
+// Counterpart to glNewList (in GL_COMPILE mode); everything from myBegin
+// through myEnd, along with myTranslate/myRotate/myScale, myBindTexture and
+// the lighting calls, is recorded into the given list instead of being
+// drawn. Transformations are baked into the recorded vertices; myFrustum and
+// myLookAt still take effect immediately.
+void myNewList(int list);
+
+// Counterpart to glEndList; stops recording.
+void myEndList();
+
+// Counterpart to glCallList; replays a recorded list with the current
+// matrices.
+void myCallList(int list);
+
+// Counterpart to glDeleteLists; frees a single list.
+void myDeleteList(int list);
+
+
 #endif
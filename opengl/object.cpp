@@ -4,7 +4,13 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <cfloat>
+#include <cmath>
 
 #ifdef __APPLE__
 #  include <GLUT/glut.h>
@@ -15,6 +21,8 @@
 #include "linalg.hpp"
 #include "mygl.hpp"
 #include "object.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
 
 
 // Initilize the object cache.
@@ -23,7 +31,6 @@ std::map<std::string,Object> Object::cache_;
 
 void Vertex::draw(Object const &obj) const {
     // Indices can be -1 to indicate that data does not exist.
-    // We don't do anything with normals because there isn't a myNormal.
     if (ti_ >= 0) {
         myTexCoord(obj.texCoords_[ti_][0], obj.texCoords_[ti_][1]);
     }
@@ -39,6 +46,8 @@ void Vertex::draw(Object const &obj) const {
 
 bool Object::readOBJ(std::string const &filename) {
 
+    TRACE_SCOPE("Object::readOBJ");
+
     // Try to open the file.
     std::ifstream file(filename.c_str());
     if (!file.good()) {
@@ -76,6 +85,15 @@ bool Object::readOBJ(std::string const &filename) {
                 opStream >> vec[i];
             }
 
+            // Positions may be followed by a color, as point clouds often
+            // are ("v x y z r g b"); positions before the first one are white.
+            double green, blue;
+            if (opCode == "v" && opStream >> green >> blue) {
+                pointColors_.resize(positions_.size(), Vector(1, 1, 1));
+                pointColors_.push_back(Vector(vec[3], green, blue));
+                vec[3] = 0;
+            }
+
             // Store this data in the right location.
             switch (opCode.size() > 1 ? opCode[1] : 'v') {
                 case 'v':
@@ -98,12 +116,10 @@ bool Object::readOBJ(std::string const &filename) {
         // A polygon (or face).
         } else if (opCode == "f") {
             std::vector<Vertex> polygon;
-            // Limit to 4 as we only can handle triangles and quads.
-            for (int i = 0; opStream.good() && i < 4; i++) {
-
-                // Retrieve a full vertex specification.
-                std::string vertexString;
-                opStream >> vertexString;
+            // Faces may have any number of vertices (drawn as convex
+            // polygons).
+            std::string vertexString;
+            while (opStream >> vertexString) {
 
                 // Parse the vertex into a set of indices for position,
                 // texCoord, normal, and colour, respectively.
@@ -130,7 +146,7 @@ bool Object::readOBJ(std::string const &filename) {
 
             }
 
-            // Only accept triangles and quads.
+            // Only accept polygons (of three or more vertices).
             if (polygon.size() >= 3) {
                 polygons_.push_back(polygon);
             }
@@ -146,80 +162,535 @@ bool Object::readOBJ(std::string const &filename) {
 }
 
 
-void Object::fillNormals() {
-    // Walk through all of the polygons...
+// Positions closer together than about this (once normalized) are welded
+// into one when smoothing normals, so that seams in a mesh do not show.
+static double const weldDistance = 1e-5;
+
+
+// The key of a cell in the spatial hash used for welding.
+static long long cellKey(int const *cell, int dx, int dy, int dz) {
+    return ((long long)((cell[0] + dx) & 2097151) << 42) |
+           ((long long)((cell[1] + dy) & 2097151) << 21) |
+           (long long)((cell[2] + dz) & 2097151);
+}
+
+
+void Object::postProcess() {
+
+    TRACE_SCOPE("Object::postProcess");
+
+    int const grain = 4096;
+    int count = positions_.size();
+    if (!count) {
+        return;
+    }
+
+    // Calculate the bounding box, one chunk of positions at a time.
+    int chunks = parallelChunkCount(count, grain);
+    std::vector<Vector> chunkMin(chunks, Vector(DBL_MAX, DBL_MAX, DBL_MAX));
+    std::vector<Vector> chunkMax(chunks, Vector(-DBL_MAX, -DBL_MAX, -DBL_MAX));
+    parallelFor(count, grain, [&](int chunk, int begin, int end) {
+        Vector &minCoord = chunkMin[chunk];
+        Vector &maxCoord = chunkMax[chunk];
+        for (int i = begin; i < end; i++) {
+            for (int j = 0; j < 3; j++) {
+                minCoord[j] = std::min(minCoord[j], positions_[i][j]);
+                maxCoord[j] = std::max(maxCoord[j], positions_[i][j]);
+            }
+        }
+    });
+    Vector minCoord = chunkMin[0];
+    Vector maxCoord = chunkMax[0];
+    for (int c = 1; c < chunks; c++) {
+        for (int j = 0; j < 3; j++) {
+            minCoord[j] = std::min(minCoord[j], chunkMin[c][j]);
+            maxCoord[j] = std::max(maxCoord[j], chunkMax[c][j]);
+        }
+    }
+
+    // Calculate the center of the box.
+    Vector offset = (minCoord + maxCoord) / 2.0 ;
+
+    // Calculate a scale that brings us to an average unit size.
+    double scale = 0;
+    for (int i = 0; i < 3; i++) {
+        scale += maxCoord[i] - minCoord[i];
+    }
+    scale = scale > 0 ? 2.0 / (scale / 3.0) : 1.0;
+    min_ = (minCoord - offset) * scale;
+    max_ = (maxCoord - offset) * scale;
+
+    // Transform all of the positional data with these values, and find the
+    // cell of a spatial hash (weldDistance across) each position falls in.
+    std::vector<int> cells(3 * count);
+    parallelFor(count, grain, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            for (int j = 0; j < 3; j++) {
+                positions_[i][j] = (positions_[i][j] - offset[j]) * scale;
+                cells[3 * i + j] = int(floor(positions_[i][j] / weldDistance));
+            }
+        }
+    });
+
+    // Find the polygons without normals; if there are none, only colors may
+    // be missing.
+    std::vector<int> faces;
     for (int i = 0; i < polygons_.size(); i++) {
-        std::vector<Vertex> &polygon = polygons_[i];
-        // ... and if it doesn't have normals set...
-        if (polygon[0].ni_ < 0) {
-            // ... calculate one...
+        if (polygons_[i][0].ni_ < 0) {
+            faces.push_back(i);
+        }
+    }
+
+    // Weld each position to the first one in its cell or a neighbouring one.
+    // This is done serially, as which position one welds to depends on every
+    // position before it.
+    std::vector<int> welded(count);
+    if (faces.size()) {
+        std::unordered_map<long long,int> hash;
+        for (int i = 0; i < count; i++) {
+            int const *cell = &cells[3 * i];
+            welded[i] = i;
+            for (int n = 0; n < 27 && welded[i] == i; n++) {
+                std::unordered_map<long long,int>::const_iterator it =
+                    hash.find(cellKey(cell, n % 3 - 1, n / 3 % 3 - 1, n / 9 - 1));
+                if (it != hash.end()) {
+                    welded[i] = it->second;
+                }
+            }
+            if (welded[i] == i) {
+                hash[cellKey(cell, 0, 0, 0)] = i;
+            }
+        }
+    }
+
+    // Find each face's normal; the sum of its fan's cross products is twice
+    // its area along the normal.
+    std::vector<Vector> faceNormals(faces.size());
+    parallelFor(faces.size(), grain, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            std::vector<Vertex> const &polygon = polygons_[faces[i]];
             Vector const &a = positions_[polygon[0].pi_];
-            Vector const &b = positions_[polygon[1].pi_];
-            Vector const &c = positions_[polygon[2].pi_];
-            Vector normal = (b - a).cross(c - a);
-            normal.normalize();
-            // ... and set all of the verticies to use it.
-            normals_.push_back(normal);
+            for (int j = 2; j < polygon.size(); j++) {
+                faceNormals[i] = faceNormals[i] +
+                    (positions_[polygon[j - 1].pi_] - a).cross(positions_[polygon[j].pi_] - a, 0);
+            }
+        }
+    });
+
+    // List the corners (as face and corner within it) at each welded vertex,
+    // in order of face, so each vertex's normal can be summed on its own.
+    std::vector<int> cornerStarts(count + 1, 0);
+    for (int i = 0; i < faces.size(); i++) {
+        std::vector<Vertex> const &polygon = polygons_[faces[i]];
+        for (int j = 0; j < polygon.size(); j++) {
+            cornerStarts[welded[polygon[j].pi_] + 1]++;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        cornerStarts[i + 1] += cornerStarts[i];
+    }
+    std::vector<std::pair<int,int> > corners(cornerStarts[count]);
+    {
+        std::vector<int> next(cornerStarts.begin(), cornerStarts.end() - 1);
+        for (int i = 0; i < faces.size(); i++) {
+            std::vector<Vertex> const &polygon = polygons_[faces[i]];
             for (int j = 0; j < polygon.size(); j++) {
-                polygon[j].ni_ = normals_.size() - 1;
+                corners[next[welded[polygon[j].pi_]]++] = std::make_pair(i, j);
             }
         }
     }
-}
-
 
-void Object::fillColors() {
-    // Walk through all of the polygons...
+    // Give every welded vertex used by these faces a slot in normals_, and
+    // every normal used by a vertex without a color a slot in colors_, so
+    // that both can be sized once and filled in place.
+    std::vector<int> normalSlots(count, -1);
+    int normalBase = normals_.size();
+    int normalCount = normalBase;
+    for (int i = 0; i < faces.size(); i++) {
+        std::vector<Vertex> &polygon = polygons_[faces[i]];
+        for (int j = 0; j < polygon.size(); j++) {
+            int &slot = normalSlots[welded[polygon[j].pi_]];
+            if (slot < 0) {
+                slot = normalCount++;
+            }
+            polygon[j].ni_ = slot;
+        }
+    }
+    std::vector<int> colorSlots(normalCount, -1);
+    int colorCount = colors_.size();
     for (int i = 0; i < polygons_.size(); i++) {
         std::vector<Vertex> &polygon = polygons_[i];
-        // ... and all of their vertices.
         for (int j = 0; j < polygon.size(); j++) {
-            // If they don't have a color, but do have a normal...
+            // Vertices without a color, but with a normal, share a color made
+            // from that normal.
             if (polygon[j].ci_ < 0 && polygon[j].ni_ >= 0) {
-                // Set their color based off the normal.
-                Vector color = (normals_[polygon[j].ni_] + Vector(1, 1, 1)) * 0.5;
-                colors_.push_back(color);
-                polygon[j].ci_ = colors_.size() - 1;
+                int &slot = colorSlots[polygon[j].ni_];
+                if (slot < 0) {
+                    slot = colorCount++;
+                }
+                polygon[j].ci_ = slot;
             }
         }
     }
+    normals_.resize(normalCount);
+    colors_.resize(colorCount);
+
+    // Every corner adds its face's normal to its (welded) vertex, weighted by
+    // the face's area and the angle at the corner. Then fill in the colors
+    // made from every normal.
+    parallelFor(count, grain, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int slot = normalSlots[i];
+            if (slot < 0) {
+                continue;
+            }
+            Vector normal;
+            for (int c = cornerStarts[i]; c < cornerStarts[i + 1]; c++) {
+                std::vector<Vertex> const &polygon = polygons_[faces[corners[c].first]];
+                int n = polygon.size(), j = corners[c].second;
+                Vector const &p = positions_[polygon[j].pi_];
+                Vector e0 = positions_[polygon[(j + 1) % n].pi_] - p;
+                Vector e1 = positions_[polygon[(j + n - 1) % n].pi_] - p;
+                double lengths = e0.length() * e1.length();
+                if (lengths == 0) {
+                    continue;
+                }
+                double angle = acos(std::max(-1.0, std::min(1.0, e0.dot(e1) / lengths)));
+                normal = normal + faceNormals[corners[c].first] * angle;
+            }
+            if (normal.length2() > 0) {
+                normal.normalize();
+            }
+            normals_[slot] = normal;
+            if (colorSlots[slot] >= 0) {
+                colors_[colorSlots[slot]] = (normal + Vector(1, 1, 1)) * 0.5;
+            }
+        }
+    });
+    for (int i = 0; i < normalBase; i++) {
+        if (colorSlots[i] >= 0) {
+            colors_[colorSlots[i]] = (normals_[i] + Vector(1, 1, 1)) * 0.5;
+        }
+    }
 
+    // Give every point of a point cloud a color: white if only earlier ones
+    // were given one, or one made from where it is in the box if none were.
+    if (polygons_.empty()) {
+        if (pointColors_.size()) {
+            pointColors_.resize(count, Vector(1, 1, 1));
+        } else {
+            pointColors_.resize(count);
+            Vector size = max_ - min_;
+            parallelFor(count, grain, [&](int chunk, int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    for (int j = 0; j < 3; j++) {
+                        pointColors_[i][j] = size[j] > 0 ? (positions_[i][j] - min_[j]) / size[j] : 1;
+                    }
+                }
+            });
+        }
+    }
 }
 
 
-void Object::normalize() {
 
-    // Calculate the bounding box.
-    Vector minCoord(DBL_MAX, DBL_MAX, DBL_MAX);
-    Vector maxCoord(DBL_MIN, DBL_MIN, DBL_MIN);
-    for (int i = 0; i < positions_.size(); i++) {
-        for (int j = 0; j < 3; j++) {
-            minCoord[j] = std::min(minCoord[j], positions_[i][j]);
-            maxCoord[j] = std::max(maxCoord[j], positions_[i][j]);
+// The fraction of the original triangles each level of detail keeps.
+static int const lodLevels = 4;
+static double const lodFractions[lodLevels] = {0.5, 0.25, 0.12, 0.06};
+
+
+struct LevelsOfDetail {
+
+    // The builder's own copy of the geometry it simplifies, so that it does
+    // not depend on any copy of the Object outliving it; freed once every
+    // level is built.
+    std::vector<Vector> positions;
+    std::vector<std::vector<Vertex> > polygons;
+
+    // The triangles of each level, of which the first `ready` are built.
+    // Levels are never touched again once ready.
+    std::vector<std::vector<Vertex> > levels[lodLevels];
+    std::atomic<int> ready;
+
+    // How many triangles the original polygons make, and the radius of a
+    // sphere about the origin containing them (set before any level is
+    // ready).
+    int triangles;
+    double radius;
+
+    // The thread building the levels, and a flag to tell it to give up.
+    std::thread builder;
+    std::atomic<bool> cancelled;
+
+    LevelsOfDetail() : ready(0), triangles(0), radius(0), cancelled(false) {}
+
+    ~LevelsOfDetail() {
+        cancelled = true;
+        if (builder.joinable()) {
+            builder.join();
         }
     }
 
+};
 
-    // Calculate the center of the box.
-    Vector offset = (minCoord + maxCoord) / 2.0 ;
 
-    // Calculate a scale that brings us to an average unit size.
-    double scale = 0;
-    for (int i = 0; i < 3; i++) {
-        scale += maxCoord[i] - minCoord[i];
+// A symmetric 4x4 matrix (stored as its upper triangle) whose error() is the
+// sum of squared distances from a point to a set of planes: Garland and
+// Heckbert's quadric error metric.
+struct Quadric {
+
+    double a[10];
+
+    Quadric() {
+        for (int i = 0; i < 10; i++) {
+            a[i] = 0;
+        }
+    }
+
+    // Adds the plane n.p + d = 0 (with n unit length), with the given weight.
+    void addPlane(Vector const &n, double d, double weight) {
+        double x = n[0], y = n[1], z = n[2];
+        a[0] += weight * x * x; a[1] += weight * x * y; a[2] += weight * x * z; a[3] += weight * x * d;
+        a[4] += weight * y * y; a[5] += weight * y * z; a[6] += weight * y * d;
+        a[7] += weight * z * z; a[8] += weight * z * d;
+        a[9] += weight * d * d;
+    }
+
+    void operator+=(Quadric const &other) {
+        for (int i = 0; i < 10; i++) {
+            a[i] += other.a[i];
+        }
     }
-    scale = 2.0 / (scale / 3.0);
 
-    // Transform all of the positional data with these values.
-    for (int i = 0; i < positions_.size(); i++) {
+    double error(Vector const &p) const {
+        double x = p[0], y = p[1], z = p[2];
+        return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x +
+               a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y +
+               a[7] * z * z + 2 * a[8] * z +
+               a[9];
+    }
+
+};
+
+
+// A candidate edge collapse, moving one vertex onto another. It is stale if
+// either vertex has changed since (per their versions).
+struct Collapse {
+    double cost;
+    int from, to;
+    int fromVersion, toVersion;
+    bool operator<(Collapse const &other) const { return cost > other.cost; }
+};
+
+
+// Builds levels of detail from the geometry in lods; runs on its own thread.
+static void buildLevelsOfDetail(LevelsOfDetail &lods) {
+
+    TRACE_SCOPE("buildLevelsOfDetail");
+
+    // Name every position by the first one at the same place, so that seams
+    // in the vertex data are not treated as edges of the surface.
+    std::map<std::vector<double>,int> named;
+    std::vector<int> name(lods.positions.size());
+    double radius = 0;
+    for (int i = 0; i < lods.positions.size(); i++) {
+        std::vector<double> key(3);
         for (int j = 0; j < 3; j++) {
-            positions_[i][j] -= offset[j];
-            positions_[i][j] *= scale;
+            key[j] = lods.positions[i][j];
+        }
+        name[i] = named.insert(std::make_pair(key, i)).first->second;
+        radius = std::max(radius, lods.positions[i].length());
+    }
+
+    // Split every polygon into triangles.
+    struct Triangle {
+        Vertex corners[3];
+        int v[3];
+        bool alive;
+        bool has(int vertex) const { return v[0] == vertex || v[1] == vertex || v[2] == vertex; }
+    };
+    std::vector<Triangle> triangles;
+    for (int i = 0; i < lods.polygons.size(); i++) {
+        std::vector<Vertex> const &polygon = lods.polygons[i];
+        for (int j = 2; j < polygon.size(); j++) {
+            Triangle t = {{polygon[0], polygon[j - 1], polygon[j]}, {0, 0, 0}, true};
+            for (int k = 0; k < 3; k++) {
+                t.v[k] = name[t.corners[k].pi_];
+            }
+            triangles.push_back(t);
+        }
+    }
+    lods.triangles = triangles.size();
+    lods.radius = radius;
+    std::vector<std::vector<Vertex> >().swap(lods.polygons);
+
+    // Sum the planes of the triangles around each vertex into its quadric,
+    // along with planes holding the surface's boundary edges in place.
+    std::vector<Quadric> quadrics(lods.positions.size());
+    std::vector<std::vector<int> > around(lods.positions.size());
+    std::map<std::pair<int,int>,int> edgeUses;
+    for (int i = 0; i < triangles.size(); i++) {
+        Triangle const &t = triangles[i];
+        Vector const &p0 = lods.positions[t.v[0]];
+        Vector normal = (lods.positions[t.v[1]] - p0).cross(lods.positions[t.v[2]] - p0, 0);
+        double area = normal.length() / 2;
+        if (area > 0) {
+            normal.normalize();
+        }
+        for (int k = 0; k < 3; k++) {
+            quadrics[t.v[k]].addPlane(normal, -normal.dot(p0), area);
+            around[t.v[k]].push_back(i);
+            int a = t.v[k], b = t.v[(k + 1) % 3];
+            edgeUses[std::make_pair(std::min(a, b), std::max(a, b))]++;
+        }
+    }
+    for (int i = 0; i < triangles.size(); i++) {
+        Triangle const &t = triangles[i];
+        Vector const &p0 = lods.positions[t.v[0]];
+        Vector normal = (lods.positions[t.v[1]] - p0).cross(lods.positions[t.v[2]] - p0, 0);
+        for (int k = 0; k < 3; k++) {
+            int a = t.v[k], b = t.v[(k + 1) % 3];
+            if (edgeUses[std::make_pair(std::min(a, b), std::max(a, b))] != 1) {
+                continue;
+            }
+            Vector edge = lods.positions[b] - lods.positions[a];
+            Vector side = edge.cross(normal, 0);
+            if (side.length2() > 0) {
+                side.normalize();
+                double weight = 100 * edge.length2();
+                quadrics[a].addPlane(side, -side.dot(lods.positions[a]), weight);
+                quadrics[b].addPlane(side, -side.dot(lods.positions[a]), weight);
+            }
+        }
+    }
+
+    // Queue up collapsing every edge, in whichever direction costs less.
+    std::vector<int> versions(lods.positions.size(), 0);
+    std::vector<bool> removed(lods.positions.size(), false);
+    std::priority_queue<Collapse> queue;
+    auto addEdge = [&](int a, int b) {
+        Quadric q = quadrics[a];
+        q += quadrics[b];
+        double toB = q.error(lods.positions[b]);
+        double toA = q.error(lods.positions[a]);
+        Collapse c = {std::min(toA, toB), toB <= toA ? a : b, toB <= toA ? b : a, 0, 0};
+        c.fromVersion = versions[c.from];
+        c.toVersion = versions[c.to];
+        queue.push(c);
+    };
+    for (std::map<std::pair<int,int>,int>::const_iterator it = edgeUses.begin(); it != edgeUses.end(); ++it) {
+        addEdge(it->first.first, it->first.second);
+    }
+
+    int alive = triangles.size();
+    for (int level = 0; level < lodLevels; level++) {
+
+        int target = int(lodFractions[level] * lods.triangles);
+        while (alive > target && !queue.empty()) {
+            if (lods.cancelled) {
+                return;
+            }
+            Collapse c = queue.top();
+            queue.pop();
+            if (removed[c.from] || removed[c.to] ||
+                versions[c.from] != c.fromVersion || versions[c.to] != c.toVersion) {
+                continue;
+            }
+
+            // Don't let any triangle that survives the collapse flip over.
+            Vector const &destination = lods.positions[c.to];
+            bool flips = false;
+            Vertex const *toCorner = NULL;
+            for (int i = 0; i < around[c.from].size() && !flips; i++) {
+                Triangle const &t = triangles[around[c.from][i]];
+                if (!t.alive) {
+                    continue;
+                }
+                if (t.has(c.to)) {
+                    for (int k = 0; k < 3; k++) {
+                        if (t.v[k] == c.to) {
+                            toCorner = &t.corners[k];
+                        }
+                    }
+                    continue;
+                }
+                Vector p[3], q[3];
+                for (int k = 0; k < 3; k++) {
+                    p[k] = lods.positions[t.v[k]];
+                    q[k] = t.v[k] == c.from ? destination : p[k];
+                }
+                Vector before = (p[1] - p[0]).cross(p[2] - p[0], 0);
+                Vector after = (q[1] - q[0]).cross(q[2] - q[0], 0);
+                flips = before.dot(after) <= 0;
+            }
+            if (flips || !toCorner) {
+                continue;
+            }
+
+            // Move the vertex, dropping the triangles along the edge, and
+            // giving the rest the vertex data of the one it moved onto.
+            Vertex corner = *toCorner;
+            for (int i = 0; i < around[c.from].size(); i++) {
+                int ti = around[c.from][i];
+                Triangle &t = triangles[ti];
+                if (!t.alive) {
+                    continue;
+                }
+                if (t.has(c.to)) {
+                    t.alive = false;
+                    alive--;
+                    continue;
+                }
+                for (int k = 0; k < 3; k++) {
+                    if (t.v[k] == c.from) {
+                        t.v[k] = c.to;
+                        t.corners[k] = corner;
+                    }
+                }
+                around[c.to].push_back(ti);
+            }
+            removed[c.from] = true;
+            quadrics[c.to] += quadrics[c.from];
+            versions[c.to]++;
+
+            // Requeue the edges around the vertex, whose costs have changed.
+            std::vector<int> neighbours;
+            for (int i = 0; i < around[c.to].size(); i++) {
+                Triangle const &t = triangles[around[c.to][i]];
+                for (int k = 0; t.alive && k < 3; k++) {
+                    if (t.v[k] != c.to &&
+                        std::find(neighbours.begin(), neighbours.end(), t.v[k]) == neighbours.end()) {
+                        neighbours.push_back(t.v[k]);
+                    }
+                }
+            }
+            for (int i = 0; i < neighbours.size(); i++) {
+                addEdge(c.to, neighbours[i]);
+            }
+        }
+
+        // Keep what is left as this level.
+        std::vector<std::vector<Vertex> > &polygons = lods.levels[level];
+        for (int i = 0; i < triangles.size(); i++) {
+            if (triangles[i].alive) {
+                polygons.push_back(std::vector<Vertex>(triangles[i].corners, triangles[i].corners + 3));
+            }
         }
+        lods.ready.store(level + 1, std::memory_order_release);
     }
+    std::vector<Vector>().swap(lods.positions);
 }
 
 
+void Object::startLevelsOfDetail() {
+    if (polygons_.size()) {
+        lods_ = std::make_shared<LevelsOfDetail>();
+        lods_->positions = positions_;
+        lods_->polygons = polygons_;
+        lods_->builder = std::thread(buildLevelsOfDetail, std::ref(*lods_));
+    }
+}
+
 
 Object& Object::fromFile(std::string const &filename) {
     // Retrieve the object from the cache.
@@ -227,19 +698,119 @@ Object& Object::fromFile(std::string const &filename) {
     // Load it if it isn't already.
     if (!obj.good()) {
         obj.readOBJ(filename);
-        obj.normalize();
-        obj.fillNormals();
-        obj.fillColors();
+        obj.postProcess();
+        obj.startLevelsOfDetail();
     }
     return obj;
 }
 
 
+void Object::preload(std::vector<std::string> const &filenames) {
+
+    TRACE_SCOPE("Object::preload");
+
+    // Find what is not loaded yet; only this thread touches the cache.
+    std::vector<std::string> names;
+    std::vector<Object*> objects;
+    for (int i = 0; i < filenames.size(); i++) {
+        Object &obj = Object::cache_[filenames[i]];
+        if (!obj.good() && std::find(objects.begin(), objects.end(), &obj) == objects.end()) {
+            names.push_back(filenames[i]);
+            objects.push_back(&obj);
+        }
+    }
+
+    // Each Object is only touched by the thread loading it.
+    parallelFor(objects.size(), 1, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            objects[i]->readOBJ(names[i]);
+            objects[i]->postProcess();
+        }
+    });
+    for (int i = 0; i < objects.size(); i++) {
+        objects[i]->startLevelsOfDetail();
+    }
+}
+
+
+std::vector<std::vector<Vertex> > const &Object::polygonsFor(Matrix const *transforms, int count) const {
+
+    int ready = lods_ ? lods_->ready.load(std::memory_order_acquire) : 0;
+    if (!ready) {
+        return polygons_;
+    }
+
+    // Find the largest that any copy appears.
+    double size = 0;
+    for (int i = 0; i < count; i++) {
+        Matrix const &m = transforms[i];
+        double scale = 0;
+        for (int c = 0; c < 3; c++) {
+            scale = std::max(scale, Vector(m[0][c], m[1][c], m[2][c]).length());
+        }
+        size = std::max(size, myProjectedSize(m[0][3], m[1][3], m[2][3], lods_->radius * scale));
+    }
+
+    // Use the simplest level (built so far) that has at least as many
+    // triangles as there are pixels to cover, as anything more is wasted.
+    double pixels = size * size * M_PI / 4;
+    if (lods_->triangles <= pixels) {
+        return polygons_;
+    }
+    int level = 0;
+    while (level + 1 < ready && lods_->levels[level + 1].size() >= pixels) {
+        level++;
+    }
+    return lods_->levels[level];
+}
+
+
 void Object::draw() const {
+    if (polygons_.empty()) {
+        myDrawPoints(&positions_[0], &pointColors_[0], positions_.size());
+        return;
+    }
+    Matrix identity = Matrix::identity();
+    drawPolygons(polygonsFor(&identity, 1));
+}
+
+
+void Object::drawInstanced(Matrix const *transforms, int count) const {
+
+    TRACE_SCOPE("Object::drawInstanced");
+
+    // Give every point of a point cloud once, as a single batch.
+    if (polygons_.empty()) {
+        myBegin(GL_POINTS);
+        for (int i = 0; i < positions_.size(); i++) {
+            myColor(pointColors_[i][0], pointColors_[i][1], pointColors_[i][2]);
+            myVertex(positions_[i][0], positions_[i][1], positions_[i][2]);
+        }
+        myDrawInstanced(transforms, count);
+        return;
+    }
+
+    // Give every triangle once, as a single batch, fanning out larger
+    // polygons.
+    std::vector<std::vector<Vertex> > const &polygons = polygonsFor(transforms, count);
+    myBegin(GL_TRIANGLES);
+    for (int poly_i = 0; poly_i < polygons.size(); poly_i++) {
+        std::vector<Vertex> const &polygon = polygons[poly_i];
+        for (int i = 2; i < polygon.size(); i++) {
+            polygon[0].draw(*this);
+            polygon[i - 1].draw(*this);
+            polygon[i].draw(*this);
+        }
+    }
+    myDrawInstanced(transforms, count);
+}
+
+
+void Object::drawPolygons(std::vector<std::vector<Vertex> > const &polygons) const {
 
     // Walk across all of the polygons.
-    for (int poly_i = 0; poly_i < polygons_.size(); poly_i++) {
-        std::vector<Vertex> const *polygon = &polygons_[poly_i];
+    for (int poly_i = 0; poly_i < polygons.size(); poly_i++) {
+        std::vector<Vertex> const *polygon = &polygons[poly_i];
 
         // Draw triangles directly.
         if (polygon->size() == 3) {
@@ -249,17 +820,12 @@ void Object::draw() const {
             }
             myEnd();
 
-        // Split quads into two triangles.
-        } else if (polygon->size() == 4) {
-            myBegin(GL_TRIANGLES);
-            (*polygon)[0].draw(*this);
-            (*polygon)[1].draw(*this);
-            (*polygon)[2].draw(*this);
-            myEnd();
-            myBegin(GL_TRIANGLES);
-            (*polygon)[2].draw(*this);
-            (*polygon)[3].draw(*this);
-            (*polygon)[0].draw(*this);
+        // Draw quads (and larger polygons) whole, giving each vertex once.
+        } else if (polygon->size() >= 4) {
+            myBegin(polygon->size() == 4 ? GL_QUADS : GL_POLYGON);
+            for (int i = 0; i < polygon->size(); i++) {
+                (*polygon)[i].draw(*this);
+            }
             myEnd();
         }
     }
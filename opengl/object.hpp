@@ -7,6 +7,7 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <memory>
 
 #include "linalg.hpp"
 #include "mygl.hpp"
@@ -14,6 +15,9 @@
 
 class Object;
 
+// Simplified versions of an Object; see Object::fromFile().
+struct LevelsOfDetail;
+
 
 // A class to represent a single vertex of a polygon. The ints stored within
 // are indices into the positions/texCoords/normals/colors vectors of the
@@ -52,35 +56,70 @@ protected:
     // Polygons are a set of vertices.
     std::vector<std::vector<Vertex> > polygons_;
 
+    // The color of each position, if there are no polygons (a point cloud).
+    std::vector<Vector> pointColors_;
+
+    // The bounding box of positions_.
+    Vector min_, max_;
+
     // A mapping of filenames to already loaded Objects.
     static std::map<std::string,Object> cache_;
 
     // Read OBJ data from a given file.
     bool readOBJ(std::string const &filename);
 
-    // Calculates missing normals.
-    void fillNormals();
+    // Centers and resizes the object to be nearly unit size, then calculates
+    // missing normals (smoothed across faces sharing a welded position) and
+    // fills in missing colors with normals (one per normal). Runs as a few
+    // parallel passes over the data, writing everything in place.
+    void postProcess();
+
+    // Simplified versions of polygons_ (made of triangles that use the same
+    // vertex data), built on another thread (from its own copy of the
+    // geometry) after loading. Shared by copies of this Object, and declared
+    // last so it is destroyed (stopping the build) first.
+    std::shared_ptr<LevelsOfDetail> lods_;
 
-    // Fills in missing colors with normals.
-    void fillColors();
+    // Starts building levels of detail in the background, once loaded.
+    void startLevelsOfDetail();
 
-    // Centers and resizes the object to be nearly unit size.
-    void normalize();
+    // Draws the given polygons.
+    void drawPolygons(std::vector<std::vector<Vertex> > const &polygons) const;
+
+    // The polygons to draw copies with the given transforms with: the
+    // simplest level of detail (that has been built) with about as many
+    // triangles as the largest copy covers virtual pixels.
+    std::vector<std::vector<Vertex> > const &polygonsFor(Matrix const *transforms, int count) const;
 
 public:
 
     Object() {}
 
     // Parses an Object from a file, or retrieves it from the cache if we
-    // have seen it before.
+    // have seen it before. Once loaded, a chain of simplified levels of
+    // detail is built in the background.
     static Object& fromFile(std::string const &filename);
 
-    // Is there data here?
-    bool good() const { return polygons_.size(); }
+    // Loads all of the given files that are not in the cache yet, several at
+    // once, so that fromFile() finds them there.
+    static void preload(std::vector<std::string> const &filenames);
+
+    // Is there data here? An OBJ with positions but no faces is a point
+    // cloud.
+    bool good() const { return positions_.size(); }
 
-    // Draw the object.
+    // The bounding box of the (centered and resized) object.
+    Vector const &min() const { return min_; }
+    Vector const &max() const { return max_; }
+
+    // Draw the object, at the level of detail picked by polygonsFor(). A
+    // point cloud is drawn with myDrawPoints(), whatever drawAsPoints is.
     void draw() const;
 
+    // Draw count copies of the object, each first transformed by its own
+    // matrix, as a single batch with myDrawInstanced().
+    void drawInstanced(Matrix const *transforms, int count) const;
+
 };
 
 
@@ -0,0 +1,161 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Minimal parallel loops: the range is split into one contiguous chunk per
+// hardware thread (or fewer, if the range is small), and the chunks are run
+// at once. parallelFor() starts a thread for each chunk, which is cheap next
+// to load-time work, and lets loops nest. parallelForPooled() hands them to
+// threads started once and kept waiting, for loops run every frame, where
+// starting threads (tens of microseconds each) would be a real cost.
+
+
+// How many threads parallelFor() splits work across, at most.
+inline int parallelThreadCount() {
+    static int const count = std::max(1u, std::thread::hardware_concurrency());
+    return count;
+}
+
+
+// How many chunks parallelFor() splits a range of the given size into, given
+// the fewest items worth starting a thread for. Useful for sizing per-chunk
+// results (e.g. partial sums) before the loop.
+inline int parallelChunkCount(int count, int grain) {
+    return std::max(1, std::min(parallelThreadCount(), count / std::max(1, grain)));
+}
+
+
+// Calls body(chunk, begin, end) for contiguous chunks covering [0, count),
+// with chunk numbered from 0 to parallelChunkCount(count, grain) - 1. The
+// calling thread runs the first chunk itself, and all have finished when this
+// returns.
+template <class Body>
+void parallelFor(int count, int grain, Body const &body) {
+    int chunks = parallelChunkCount(count, grain);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < chunks; i++) {
+        int begin = int((long long)count * i / chunks);
+        int end = int((long long)count * (i + 1) / chunks);
+        threads.push_back(std::thread(std::cref(body), i, begin, end));
+    }
+    body(0, 0, int((long long)count / chunks));
+    for (int i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+
+// The worker threads behind parallelForPooled(), one fewer than
+// parallelThreadCount() (the calling thread makes up the rest). One loop
+// runs on them at a time; the workers and the calling thread each claim
+// chunks until none are left.
+class ParallelPool {
+private:
+
+    std::mutex mutex_;
+    std::condition_variable started_, finished_;
+    std::vector<std::thread> threads_;
+
+    // Held by the thread running a loop, for all of it.
+    std::mutex running_;
+
+    // The current loop. loop_ counts loops, so that a worker can tell a new
+    // one has started; busy_ counts the workers yet to finish it.
+    std::function<void(int, int, int)> const *body_;
+    int count_, chunks_;
+    unsigned loop_;
+    int busy_;
+    std::atomic<int> next_;
+
+    void runChunks() {
+        for (int i = next_++; i < chunks_; i = next_++) {
+            (*body_)(i, int((long long)count_ * i / chunks_), int((long long)count_ * (i + 1) / chunks_));
+        }
+    }
+
+    void work() {
+        unsigned seen = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            started_.wait(lock, [&] { return loop_ != seen; });
+            seen = loop_;
+            lock.unlock();
+            runChunks();
+            lock.lock();
+            if (--busy_ == 0) {
+                finished_.notify_one();
+            }
+        }
+    }
+
+public:
+
+    ParallelPool() : body_(NULL), count_(0), chunks_(0), loop_(0), busy_(0), next_(0) {
+        for (int i = 1; i < parallelThreadCount(); i++) {
+            threads_.push_back(std::thread(&ParallelPool::work, this));
+        }
+    }
+
+    // Runs body on every chunk of [0, count) and waits for them, unless
+    // another loop is already running (on another thread, or around this
+    // one), in which case it returns false without running any.
+    bool tryRun(int count, int chunks, std::function<void(int, int, int)> const &body) {
+        std::unique_lock<std::mutex> running(running_, std::try_to_lock);
+        if (!running.owns_lock()) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            body_ = &body;
+            count_ = count;
+            chunks_ = chunks;
+            next_ = 0;
+            busy_ = threads_.size();
+            loop_++;
+        }
+        started_.notify_all();
+        runChunks();
+        std::unique_lock<std::mutex> lock(mutex_);
+        finished_.wait(lock, [&] { return busy_ == 0; });
+        return true;
+    }
+
+    // The pool, started on first use. It is never destroyed, so that a loop
+    // still running at exit does not outlive it; the workers end with the
+    // process.
+    static ParallelPool &instance() {
+        static ParallelPool *pool = new ParallelPool();
+        return *pool;
+    }
+
+};
+
+
+// As parallelFor(), but on the threads of the ParallelPool, so that nothing
+// is started per call. A range too small to split runs on the calling thread
+// alone. If the pool is busy (including when called from inside another
+// pooled loop) this falls back to parallelFor().
+template <class Body>
+void parallelForPooled(int count, int grain, Body const &body) {
+    int chunks = parallelChunkCount(count, grain);
+    if (chunks == 1) {
+        body(0, 0, count);
+        return;
+    }
+    std::function<void(int, int, int)> run = std::cref(body);
+    if (!ParallelPool::instance().tryRun(count, chunks, run)) {
+        parallelFor(count, grain, body);
+    }
+}
+
+
+#endif
@@ -1,7 +1,10 @@
 #include <cstdlib>
 #include <cstdio>
+#include <cmath>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <vector>
 
 #ifdef __APPLE__
 #  include <GLUT/glut.h>
@@ -12,6 +15,8 @@
 #include "mygl.hpp"
 #include "linalg.hpp"
 #include "object.hpp"
+#include "scenegraph.hpp"
+#include "stream.hpp"
 #include "scenario.hpp"
 
 
@@ -286,9 +291,19 @@ class ScenarioH : public Scenario {
     }
 
     void display() const {
-        Object obj = Object::fromFile(objFilename);
+        // Cluster packs (see --pack) are streamed in as they are needed.
+        std::string const extension(".pack");
+        if (objFilename.size() > extension.size() &&
+            !objFilename.compare(objFilename.size() - extension.size(), extension.size(), extension)) {
+            StreamedObject::fromFile(objFilename).draw();
+            return;
+        }
+        Object &obj = Object::fromFile(objFilename);
         obj.draw();
     }
+
+    // The level of detail (or clusters) drawn depends on the camera.
+    bool isStatic() const { return false; }
 };
 
 
@@ -311,6 +326,78 @@ class ScenarioI : public Scenario {
 // Your scene.
 class ScenarioJ : public Scenario {
 
+    // Built the first time the scene is drawn, as it loads its objects.
+    mutable std::unique_ptr<SceneNode> root_;
+
+    void build() const {
+
+        root_.reset(new SceneNode());
+        Object const &cube = Object::fromFile("cube.obj");
+        Object const &teapot = Object::fromFile("teapot.obj");
+
+        // A field of cubes of varying heights (most of it out of view), in
+        // blocks so that whole blocks can be culled at once.
+        int const blocksAcross = 8;
+        int const cubesAcross = 8;
+        double const spacing = 0.25;
+        double const blockSize = cubesAcross * spacing;
+        SceneNode &field = root_->addChild();
+        for (int bi = 0; bi < blocksAcross; bi++) {
+            for (int bj = 0; bj < blocksAcross; bj++) {
+                double bx = (bi - (blocksAcross - 1) / 2.0) * blockSize;
+                double bz = (bj - (blocksAcross - 1) / 2.0) * blockSize;
+                SceneNode &block = field.addChild();
+                block.setTransform(Matrix(
+                    1, 0, 0, bx,
+                    0, 1, 0, 0,
+                    0, 0, 1, bz,
+                    0, 0, 0, 1
+                ));
+                for (int i = 0; i < cubesAcross; i++) {
+                    for (int j = 0; j < cubesAcross; j++) {
+                        double x = (i - (cubesAcross - 1) / 2.0) * spacing;
+                        double z = (j - (cubesAcross - 1) / 2.0) * spacing;
+                        double height = 0.04 + 0.03 * (1 + sin((bx + x) * 1.7) * cos((bz + z) * 1.3));
+                        SceneNode &node = block.addChild();
+                        node.setObject(&cube);
+                        node.setTransform(Matrix(
+                            0.08, 0, 0, x,
+                            0, height, 0, height - 1,
+                            0, 0, 0.08, z,
+                            0, 0, 0, 1
+                        ));
+                    }
+                }
+            }
+        }
+
+        // A ring of teapots facing the middle on top.
+        int const teapotCount = 16;
+        SceneNode &ring = root_->addChild();
+        ring.setTransform(Matrix(
+            1, 0, 0, 0,
+            0, 1, 0, -0.6,
+            0, 0, 1, 0,
+            0, 0, 0, 1
+        ));
+        for (int i = 0; i < teapotCount; i++) {
+            double angle = 2 * M_PI * i / teapotCount;
+            Matrix m = Matrix::rotation(M_PI / 2 - angle, Vector(0, 1, 0));
+            for (int r = 0; r < 3; r++) {
+                for (int c = 0; c < 3; c++) {
+                    m[r][c] *= 0.3;
+                }
+            }
+            m[0][3] = 1.5 * cos(angle);
+            m[2][3] = 1.5 * sin(angle);
+            SceneNode &node = ring.addChild();
+            node.setObject(&teapot);
+            node.setTransform(m);
+        }
+    }
+
+public:
+
     // Specific camera for this scene.
     void init(Vector &cam, Vector &focus, bool &persp) const {
         cam = Vector(2, 2.45, 4);
@@ -318,9 +405,19 @@ class ScenarioJ : public Scenario {
         persp = true;
     }
 
+    // Thousands of copies of a few objects, held in a scene graph which
+    // culls them by block and draws each run of copies as an instanced
+    // batch.
     void display() const {
-        // @@@ YOUR SCENE HERE
+        if (!root_) {
+            build();
+        }
+        root_->draw();
     }
+
+    // What is culled, and the teapots' level of detail, depend on the
+    // camera.
+    bool isStatic() const { return false; }
 };
 
 
@@ -20,6 +20,10 @@ public:
     // Display the scene.
     virtual void display() const = 0;
 
+    // Does display() issue the same commands every time? If so it is only
+    // called once, into a display list, which is replayed afterwards.
+    virtual bool isStatic() const { return true; }
+
 };
 
 
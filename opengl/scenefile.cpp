@@ -0,0 +1,175 @@
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "image.hpp"
+#include "linalg.hpp"
+#include "object.hpp"
+#include "scenario.hpp"
+#include "scenefile.hpp"
+#include "scenegraph.hpp"
+#include "trace.hpp"
+
+
+// A scenario drawing a scene graph read from a file.
+class SceneFileScenario : public Scenario {
+public:
+
+    // The camera, if the file gives one.
+    bool hasCamera;
+    Vector camera, focus;
+    bool perspective;
+
+    // Drawing updates the graph's cached matrices and bounds.
+    mutable SceneNode root;
+
+    SceneFileScenario() : hasCamera(false), perspective(true) {}
+
+    void init(Vector &cam, Vector &foc, bool &persp) const {
+        if (!hasCamera) {
+            Scenario::init(cam, foc, persp);
+            return;
+        }
+        cam = camera;
+        foc = focus;
+        persp = perspective;
+    }
+
+    void display() const {
+        root.draw();
+    }
+
+    // What is culled depends on the camera.
+    bool isStatic() const { return false; }
+};
+
+
+bool isSceneFile(std::string const &filename) {
+    std::string const extension(".scene");
+    return filename.size() > extension.size() &&
+        !filename.compare(filename.size() - extension.size(), extension.size(), extension);
+}
+
+
+// Makes a path from a scene file relative to the directory the file is in.
+static std::string resolvePath(std::string const &sceneFilename, std::string const &path) {
+    size_t slash = sceneFilename.find_last_of("/\\");
+    if (path.empty() || path[0] == '/' || path[0] == '\\' || slash == std::string::npos) {
+        return path;
+    }
+    return sceneFilename.substr(0, slash + 1) + path;
+}
+
+
+Scenario *loadSceneFile(std::string const &filename) {
+
+    TRACE_SCOPE("loadSceneFile");
+
+    std::ifstream file(filename.c_str());
+    if (!file.good()) {
+        std::cerr << "Unable to open scene file \"" << filename << "\"" << std::endl;
+        return NULL;
+    }
+
+    std::unique_ptr<SceneFileScenario> scenario(new SceneFileScenario());
+
+    // The nodes "node" has opened, and the objects to give to nodes once
+    // everything is loaded.
+    std::vector<SceneNode*> nodes(1, &scenario->root);
+    std::vector<std::pair<SceneNode*,std::string> > objects;
+    std::vector<std::string> objectFiles, textureFiles;
+
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+
+        // Drop comments, and skip blank lines.
+        line = line.substr(0, line.find('#'));
+        std::stringstream in(line);
+        std::string command;
+        if (!(in >> command)) {
+            continue;
+        }
+
+        SceneNode &node = *nodes.back();
+        bool ok = true;
+        if (command == "camera") {
+            std::string projection("perspective");
+            Vector &c = scenario->camera;
+            Vector &f = scenario->focus;
+            ok = bool(in >> c[0] >> c[1] >> c[2] >> f[0] >> f[1] >> f[2]);
+            in >> projection;
+            ok = ok && (projection == "perspective" || projection == "orthographic");
+            scenario->perspective = projection == "perspective";
+            scenario->hasCamera = ok;
+        } else if (command == "node") {
+            nodes.push_back(&node.addChild());
+        } else if (command == "end") {
+            ok = nodes.size() > 1;
+            if (ok) {
+                nodes.pop_back();
+            }
+        } else if (command == "translate") {
+            double x, y, z;
+            ok = bool(in >> x >> y >> z);
+            node.setTransform(node.transform() * Matrix(
+                1, 0, 0, x,
+                0, 1, 0, y,
+                0, 0, 1, z,
+                0, 0, 0, 1
+            ));
+        } else if (command == "rotate") {
+            double angle, x, y, z;
+            ok = bool(in >> angle >> x >> y >> z);
+            node.setTransform(node.transform() * Matrix::rotation(
+                angle * M_PI / 180.0, Vector(x, y, z).normalized()));
+        } else if (command == "scale") {
+            double x, y, z;
+            ok = bool(in >> x >> y >> z);
+            node.setTransform(node.transform() * Matrix(
+                x, 0, 0, 0,
+                0, y, 0, 0,
+                0, 0, z, 0,
+                0, 0, 0, 1
+            ));
+        } else if (command == "object") {
+            std::string path;
+            ok = bool(in >> path);
+            path = resolvePath(filename, path);
+            objects.push_back(std::make_pair(&node, path));
+            objectFiles.push_back(path);
+        } else if (command == "texture") {
+            std::string path;
+            ok = bool(in >> path);
+            path = resolvePath(filename, path);
+            node.setTexture(path);
+            textureFiles.push_back(path);
+        } else {
+            ok = false;
+        }
+
+        if (!ok) {
+            std::cerr << filename << ":" << lineNumber << ": cannot understand \"" << line << "\"" << std::endl;
+        }
+    }
+    if (nodes.size() > 1) {
+        std::cerr << filename << ": " << nodes.size() - 1 << " node(s) missing an \"end\"" << std::endl;
+    }
+
+    // Load the textures alongside the objects, then hand the objects out.
+    {
+        TRACE_SCOPE("loadSceneFile: assets");
+        std::thread textures(Image::preload, std::cref(textureFiles));
+        Object::preload(objectFiles);
+        textures.join();
+    }
+    for (int i = 0; i < objects.size(); i++) {
+        objects[i].first->setObject(&Object::fromFile(objects[i].second));
+    }
+
+    return scenario.release();
+}
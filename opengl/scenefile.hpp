@@ -0,0 +1,24 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+
+#include <string>
+
+#include "scenario.hpp"
+
+
+// Support for scenes described in text files (see the README for the
+// format). Every OBJ and PPM file a scene refers to is loaded up front,
+// several at once, before the scene is first drawn.
+
+
+// Does the given filename name a scene description (i.e. end in ".scene")?
+bool isSceneFile(std::string const &filename);
+
+// Reads a scene description, and loads all it refers to. Returns a scenario
+// drawing it, or NULL if the file could not be read. Lines that cannot be
+// understood are reported and skipped.
+Scenario *loadSceneFile(std::string const &filename);
+
+
+#endif
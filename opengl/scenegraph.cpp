@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <cfloat>
+#include <string>
+#include <vector>
+
+#include "linalg.hpp"
+#include "mygl.hpp"
+#include "object.hpp"
+#include "scenegraph.hpp"
+#include "trace.hpp"
+
+
+SceneNode::SceneNode() :
+    parent_(NULL),
+    transform_(Matrix::identity()),
+    object_(NULL),
+    world_(Matrix::identity()),
+    worldMin_(DBL_MAX, DBL_MAX, DBL_MAX),
+    worldMax_(-DBL_MAX, -DBL_MAX, -DBL_MAX),
+    transformIsDirty_(true),
+    boundsAreDirty_(true)
+    {}
+
+
+SceneNode &SceneNode::addChild() {
+    children_.push_back(std::unique_ptr<SceneNode>(new SceneNode()));
+    SceneNode &child = *children_.back();
+    child.parent_ = this;
+    boundsChanged();
+    return child;
+}
+
+
+void SceneNode::setTransform(Matrix const &transform) {
+    transform_ = transform;
+    transformIsDirty_ = true;
+    boundsChanged();
+}
+
+
+void SceneNode::setObject(Object const *object) {
+    object_ = object;
+    boundsChanged();
+}
+
+
+void SceneNode::setTexture(std::string const &texture) {
+    texture_ = texture;
+}
+
+
+void SceneNode::boundsChanged() {
+    // Stop at the first node that is already stale; its ancestors are too.
+    for (SceneNode *node = this; node && !node->boundsAreDirty_; node = node->parent_) {
+        node->boundsAreDirty_ = true;
+    }
+}
+
+
+void SceneNode::update(Matrix const &parentWorld, bool parentChanged) {
+
+    bool changed = parentChanged || transformIsDirty_;
+    if (changed) {
+        world_ = parentWorld * transform_;
+        transformIsDirty_ = false;
+        boundsAreDirty_ = true;
+    }
+
+    // Nothing at or below a clean node has changed.
+    if (!boundsAreDirty_) {
+        return;
+    }
+
+    // Start with the box around the corners of the object's box.
+    worldMin_ = Vector(DBL_MAX, DBL_MAX, DBL_MAX);
+    worldMax_ = Vector(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+    if (object_ && object_->good()) {
+        Vector const &min = object_->min();
+        Vector const &max = object_->max();
+        for (int i = 0; i < 8; i++) {
+            Vector p = world_ * Vector(i & 1 ? max[0] : min[0], i & 2 ? max[1] : min[1], i & 4 ? max[2] : min[2], 1);
+            for (int j = 0; j < 3; j++) {
+                worldMin_[j] = std::min(worldMin_[j], p[j]);
+                worldMax_[j] = std::max(worldMax_[j], p[j]);
+            }
+        }
+    }
+
+    // Then grow it around the children.
+    for (int i = 0; i < children_.size(); i++) {
+        SceneNode &child = *children_[i];
+        child.update(world_, changed);
+        for (int j = 0; j < 3; j++) {
+            worldMin_[j] = std::min(worldMin_[j], child.worldMin_[j]);
+            worldMax_[j] = std::max(worldMax_[j], child.worldMax_[j]);
+        }
+    }
+
+    boundsAreDirty_ = false;
+}
+
+
+void SceneNode::collect(std::string const *texture, std::vector<DrawItem> &items) const {
+
+    // Skip empty subtrees, and those that cannot be seen.
+    if (worldMin_[0] > worldMax_[0] ||
+        !myIsBoxVisible(worldMin_[0], worldMin_[1], worldMin_[2],
+                        worldMax_[0], worldMax_[1], worldMax_[2])) {
+        return;
+    }
+
+    if (texture_.size()) {
+        texture = &texture_;
+    }
+    if (object_ && object_->good()) {
+        DrawItem item = {object_, texture, &world_};
+        items.push_back(item);
+    }
+    for (int i = 0; i < children_.size(); i++) {
+        children_[i]->collect(texture, items);
+    }
+}
+
+
+// Do two draw items use the same texture?
+static bool sameTexture(std::string const *a, std::string const *b) {
+    return a == b || (a && b && *a == *b);
+}
+
+
+void SceneNode::draw() {
+
+    TRACE_SCOPE("SceneNode::draw");
+
+    update(Matrix::identity(), false);
+
+    std::vector<DrawItem> items;
+    {
+        TRACE_SCOPE("SceneNode::collect");
+        collect(NULL, items);
+    }
+
+    // Draw runs of the same Object and texture as one batch.
+    std::vector<Matrix> transforms;
+    std::string const *boundTexture = NULL;
+    for (int begin = 0, end; begin < items.size(); begin = end) {
+        DrawItem const &first = items[begin];
+        transforms.clear();
+        for (end = begin; end < items.size() &&
+                          items[end].object == first.object &&
+                          sameTexture(items[end].texture, first.texture); end++) {
+            transforms.push_back(*items[end].world);
+        }
+        if (!sameTexture(first.texture, boundTexture)) {
+            myBindTexture(first.texture ? first.texture->c_str() : NULL);
+            boundTexture = first.texture;
+        }
+        first.object->drawInstanced(&transforms[0], transforms.size());
+    }
+    if (boundTexture) {
+        myBindTexture(NULL);
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef SCENEGRAPH_H
+#define SCENEGRAPH_H
+
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "linalg.hpp"
+#include "object.hpp"
+
+
+// A lightweight scene graph for scenarios. Each node has a transform relative
+// to its parent, and optionally an Object to draw and a texture to draw it
+// (and everything below it) with. World matrices and world-space bounding
+// boxes are cached, and only recomputed for the parts of the tree that have
+// changed since they were last drawn.
+class SceneNode {
+private:
+
+    // The tree; a node owns its children.
+    SceneNode *parent_;
+    std::vector<std::unique_ptr<SceneNode> > children_;
+
+    // What this node holds.
+    Matrix transform_;
+    Object const *object_;
+    std::string texture_;
+
+    // The transform relative to the root, and the (axis aligned) box around
+    // everything this node and its children draw, also relative to the root;
+    // min is greater than max if they draw nothing.
+    Matrix world_;
+    Vector worldMin_, worldMax_;
+
+    // Does world_ need recomputing (here and below), and do the bounds need
+    // recomputing (here, because something here or below changed)?
+    bool transformIsDirty_;
+    bool boundsAreDirty_;
+
+    // Flags the bounds of this node and every ancestor as stale.
+    void boundsChanged();
+
+    // Brings world_ and the bounds up to date, given the parent's world
+    // matrix and whether it changed.
+    void update(Matrix const &parentWorld, bool parentChanged);
+
+    // Something to draw that survived culling: an Object, the texture to
+    // draw it with (NULL for none), and where.
+    struct DrawItem {
+        Object const *object;
+        std::string const *texture;
+        Matrix const *world;
+    };
+
+    // Adds what this node and its children draw (and can be seen) to items.
+    void collect(std::string const *texture, std::vector<DrawItem> &items) const;
+
+public:
+
+    SceneNode();
+
+    // Adds a new, empty child, and returns it.
+    SceneNode &addChild();
+
+    // The transform relative to the parent node.
+    Matrix const &transform() const { return transform_; }
+    void setTransform(Matrix const &transform);
+
+    // The Object to draw, if any (NULL for none).
+    Object const *object() const { return object_; }
+    void setObject(Object const *object);
+
+    // The texture to draw with, as for myBindTexture; empty to use the
+    // parent's.
+    std::string const &texture() const { return texture_; }
+    void setTexture(std::string const &texture);
+
+    // The transform relative to the root, as of the last draw().
+    Matrix const &worldTransform() const { return world_; }
+
+    // The box around everything this node and its children draw, relative
+    // to the root, as of the last draw(); min is greater than max if they
+    // draw nothing.
+    Vector const &worldMin() const { return worldMin_; }
+    Vector const &worldMax() const { return worldMax_; }
+
+    // Draws the tree (which should be called on the root) with the current
+    // matrices. Subtrees whose bounds cannot be seen are skipped whole, and
+    // runs of the same Object and texture are drawn as one instanced batch.
+    void draw();
+
+};
+
+
+#endif
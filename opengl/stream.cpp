@@ -0,0 +1,460 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+
+// Clusters are mapped in with mmap where there is one; Windows reads them into
+// memory instead.
+#ifdef _WIN32
+#  include <io.h>
+#  define lseek _lseeki64
+#  define fseeko _fseeki64
+#else
+#  include <sys/mman.h>
+#  include <unistd.h>
+#  define STREAM_MMAP
+#endif
+
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif
+
+#ifdef __APPLE__
+#  include <GLUT/glut.h>
+#else
+#  include <GL/glut.h>
+#endif
+
+#include "linalg.hpp"
+#include "mygl.hpp"
+#include "stream.hpp"
+#include "trace.hpp"
+
+
+// The layout of a pack: a header, then a table of clusters, then each
+// cluster's triangles (three vertices of a position and a normal, as floats),
+// starting on a boundary of packAlignment bytes so it can be mapped alone.
+static char const packMagic[8] = "A3PACK1";
+static unsigned long long const packAlignment = 65536;
+static int const floatsPerTriangle = 18;
+
+struct PackHeader {
+    char magic[8];
+    unsigned clusters;
+    unsigned reserved;
+};
+
+struct PackCluster {
+    float min[3], max[3];
+    unsigned long long offset;
+    unsigned triangles;
+    unsigned reserved;
+};
+
+// Roughly how many triangles go into each cluster.
+static int const trianglesPerCluster = 4096;
+
+// The most bytes of clusters a StreamedObject keeps mapped at once.
+static size_t const streamMemoryCap = size_t(256) << 20;
+
+// How many frames ahead of the camera's motion clusters are read ahead for.
+static double const prefetchFrames = 8;
+
+
+// Initilize the pack cache.
+std::map<std::string,StreamedObject> StreamedObject::cache_;
+
+
+// Reads the position indices of an OBJ face line (after the "f"), making
+// relative (negative) indices absolute given how many positions came before.
+// Indices are 64 bit, as packed meshes may have billions of vertices.
+static void readFace(std::istream &in, long long positionsSoFar, std::vector<long long> &face) {
+    face.clear();
+    std::string vertex;
+    while (in >> vertex) {
+        long long index = atoll(vertex.c_str());
+        face.push_back(index < 0 ? positionsSoFar + index : index - 1);
+    }
+}
+
+
+// Calls back with every face of an OBJ, and how many positions preceded it.
+template <class Callback>
+static void forEachFace(std::string const &filename, Callback const &callback) {
+    std::ifstream file(filename.c_str());
+    std::vector<long long> face;
+    long long positions = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.size() > 1 && line[0] == 'v' && isspace(line[1])) {
+            positions++;
+        } else if (line.size() > 1 && line[0] == 'f' && isspace(line[1])) {
+            std::stringstream in(line.substr(1));
+            readFace(in, positions, face);
+            callback(face);
+        }
+    }
+}
+
+
+bool packOBJ(std::string const &objFilename, std::string const &packFilename) {
+
+    TRACE_SCOPE("packOBJ");
+
+    // First pass: the positions, and their bounding box.
+    std::ifstream file(objFilename.c_str());
+    if (!file.good()) {
+        std::cerr << "Unable to open OBJ file \"" << objFilename << "\"" << std::endl;
+        return false;
+    }
+    std::vector<float> positions;
+    double minCoord[3] = {DBL_MAX, DBL_MAX, DBL_MAX};
+    double maxCoord[3] = {-DBL_MAX, -DBL_MAX, -DBL_MAX};
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.size() > 1 && line[0] == 'v' && isspace(line[1])) {
+            std::stringstream in(line.substr(1));
+            for (int j = 0; j < 3; j++) {
+                double value = 0;
+                in >> value;
+                positions.push_back(value);
+                minCoord[j] = std::min(minCoord[j], value);
+                maxCoord[j] = std::max(maxCoord[j], value);
+            }
+        }
+    }
+    file.close();
+    long long count = positions.size() / 3;
+    if (!count) {
+        std::cerr << "no positions in \"" << objFilename << "\"" << std::endl;
+        return false;
+    }
+
+    // Center and resize it as Object does.
+    double scale = 0;
+    for (int j = 0; j < 3; j++) {
+        scale += maxCoord[j] - minCoord[j];
+    }
+    scale = scale > 0 ? 2.0 / (scale / 3.0) : 1.0;
+    for (long long i = 0; i < 3 * count; i++) {
+        int j = i % 3;
+        positions[i] = float((positions[i] - (minCoord[j] + maxCoord[j]) / 2) * scale);
+    }
+    for (int j = 0; j < 3; j++) {
+        minCoord[j] = (minCoord[j] - maxCoord[j]) / 2 * scale;
+        maxCoord[j] = -minCoord[j];
+    }
+
+    // Second pass: how many triangles the faces fan out into. Third pass:
+    // area weighted normals, and how many of the triangles fall in each cell
+    // of a grid over the box, by centroid.
+    long long triangles = 0;
+    forEachFace(objFilename, [&](std::vector<long long> const &face) {
+        triangles += std::max(0LL, (long long)face.size() - 2);
+    });
+    int grid = std::max(1, std::min(32, int(ceil(cbrt(double(triangles) / trianglesPerCluster)))));
+    std::vector<float> normals(3 * count, 0);
+    std::vector<PackCluster> clusters(grid * grid * grid);
+    for (int i = 0; i < clusters.size(); i++) {
+        PackCluster &c = clusters[i];
+        for (int j = 0; j < 3; j++) {
+            c.min[j] = FLT_MAX;
+            c.max[j] = -FLT_MAX;
+        }
+        c.triangles = c.reserved = 0;
+    }
+
+    // Which cell a triangle falls in; NULL if it refers to missing positions.
+    auto cellOf = [&](long long a, long long b, long long c) -> PackCluster* {
+        if (std::min(a, std::min(b, c)) < 0 || std::max(a, std::max(b, c)) >= count) {
+            return NULL;
+        }
+        int cell = 0;
+        for (int j = 0; j < 3; j++) {
+            double centroid = (positions[3 * a + j] + positions[3 * b + j] + positions[3 * c + j]) / 3;
+            double extent = maxCoord[j] - minCoord[j];
+            int index = extent > 0 ? int((centroid - minCoord[j]) / extent * grid) : 0;
+            cell = cell * grid + std::max(0, std::min(grid - 1, index));
+        }
+        return &clusters[cell];
+    };
+
+    forEachFace(objFilename, [&](std::vector<long long> const &face) {
+        for (int k = 2; k < face.size(); k++) {
+            long long v[3] = {face[0], face[k - 1], face[k]};
+            PackCluster *cluster = cellOf(v[0], v[1], v[2]);
+            if (!cluster) {
+                continue;
+            }
+            cluster->triangles++;
+            float const *p[3];
+            for (int i = 0; i < 3; i++) {
+                p[i] = &positions[3 * v[i]];
+                for (int j = 0; j < 3; j++) {
+                    cluster->min[j] = std::min(cluster->min[j], p[i][j]);
+                    cluster->max[j] = std::max(cluster->max[j], p[i][j]);
+                }
+            }
+            Vector normal = Vector(p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2]).cross(
+                Vector(p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2]), 0);
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    normals[3 * v[i] + j] += normal[j];
+                }
+            }
+        }
+    });
+    for (long long i = 0; i < count; i++) {
+        float *n = &normals[3 * i];
+        float length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        for (int j = 0; length > 0 && j < 3; j++) {
+            n[j] /= length;
+        }
+    }
+
+    // Drop the empty cells, and lay the rest out in the file.
+    std::vector<PackCluster> kept;
+    std::vector<int> clusterOfCell(clusters.size(), -1);
+    for (int i = 0; i < clusters.size(); i++) {
+        if (clusters[i].triangles) {
+            clusterOfCell[i] = kept.size();
+            kept.push_back(clusters[i]);
+        }
+    }
+    unsigned long long offset = sizeof(PackHeader) + kept.size() * sizeof(PackCluster);
+    for (int i = 0; i < kept.size(); i++) {
+        offset = (offset + packAlignment - 1) / packAlignment * packAlignment;
+        kept[i].offset = offset;
+        offset += (unsigned long long)kept[i].triangles * floatsPerTriangle * sizeof(float);
+    }
+
+    FILE *pack = fopen(packFilename.c_str(), "wb");
+    if (!pack) {
+        std::cerr << "Unable to write pack \"" << packFilename << "\"" << std::endl;
+        return false;
+    }
+    PackHeader header;
+    memcpy(header.magic, packMagic, sizeof(header.magic));
+    header.clusters = kept.size();
+    header.reserved = 0;
+    fwrite(&header, sizeof(header), 1, pack);
+    if (!kept.empty()) {
+        fwrite(&kept[0], sizeof(PackCluster), kept.size(), pack);
+    }
+
+    // Fourth pass: write every triangle into its cluster, buffering a little
+    // of each cluster at a time.
+    std::vector<std::vector<float> > buffers(kept.size());
+    std::vector<unsigned long long> cursors(kept.size());
+    for (int i = 0; i < kept.size(); i++) {
+        cursors[i] = kept[i].offset;
+    }
+    auto flush = [&](int i) {
+        std::vector<float> &buffer = buffers[i];
+        fseeko(pack, cursors[i], SEEK_SET);
+        fwrite(&buffer[0], sizeof(float), buffer.size(), pack);
+        cursors[i] += buffer.size() * sizeof(float);
+        buffer.clear();
+    };
+    forEachFace(objFilename, [&](std::vector<long long> const &face) {
+        for (int k = 2; k < face.size(); k++) {
+            long long v[3] = {face[0], face[k - 1], face[k]};
+            PackCluster *cell = cellOf(v[0], v[1], v[2]);
+            if (!cell) {
+                continue;
+            }
+            int i = clusterOfCell[cell - &clusters[0]];
+            std::vector<float> &buffer = buffers[i];
+            for (int c = 0; c < 3; c++) {
+                buffer.insert(buffer.end(), &positions[3 * v[c]], &positions[3 * v[c]] + 3);
+                buffer.insert(buffer.end(), &normals[3 * v[c]], &normals[3 * v[c]] + 3);
+            }
+            if (buffer.size() >= 64 * floatsPerTriangle) {
+                flush(i);
+            }
+        }
+    });
+    for (int i = 0; i < kept.size(); i++) {
+        if (buffers[i].size()) {
+            flush(i);
+        }
+    }
+
+    bool ok = !ferror(pack);
+    fclose(pack);
+    return ok;
+}
+
+
+StreamedObject::~StreamedObject() {
+    for (int i = 0; i < clusters_.size(); i++) {
+        unmap(clusters_[i]);
+    }
+    if (file_ >= 0) {
+        close(file_);
+    }
+}
+
+
+bool StreamedObject::open(std::string const &filename) {
+
+    file_ = ::open(filename.c_str(), O_RDONLY | O_BINARY);
+    if (file_ < 0) {
+        std::cerr << "Unable to open pack \"" << filename << "\"" << std::endl;
+        return false;
+    }
+    filename_ = filename;
+
+    PackHeader header;
+    if (read(file_, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, packMagic, sizeof(header.magic))) {
+        std::cerr << "\"" << filename << "\" is not a pack" << std::endl;
+        return false;
+    }
+    std::vector<PackCluster> table(header.clusters);
+    size_t bytes = table.size() * sizeof(PackCluster);
+    if (bytes && read(file_, &table[0], bytes) != bytes) {
+        std::cerr << "\"" << filename << "\" is truncated" << std::endl;
+        return false;
+    }
+
+    clusters_.resize(table.size());
+    for (int i = 0; i < table.size(); i++) {
+        Cluster &c = clusters_[i];
+        memcpy(c.min, table[i].min, sizeof(c.min));
+        memcpy(c.max, table[i].max, sizeof(c.max));
+        c.offset = table[i].offset;
+        c.triangles = table[i].triangles;
+        c.data = NULL;
+        c.lastDrawn = 0;
+    }
+    return true;
+}
+
+
+bool StreamedObject::map(Cluster &cluster) {
+    TRACE_SCOPE("StreamedObject::map");
+    size_t bytes = size_t(cluster.triangles) * floatsPerTriangle * sizeof(float);
+#ifdef STREAM_MMAP
+    void *data = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, file_, cluster.offset);
+    if (data == MAP_FAILED) {
+        std::cerr << "Unable to map a cluster of \"" << filename_ << "\"" << std::endl;
+        return false;
+    }
+#else
+    float *data = new float[bytes / sizeof(float)];
+    if (lseek(file_, cluster.offset, SEEK_SET) < 0 || read(file_, data, bytes) != bytes) {
+        std::cerr << "Unable to read a cluster of \"" << filename_ << "\"" << std::endl;
+        delete [] data;
+        return false;
+    }
+#endif
+    cluster.data = (float const *)data;
+    mappedBytes_ += bytes;
+    return true;
+}
+
+
+void StreamedObject::unmap(Cluster &cluster) {
+    if (!cluster.data) {
+        return;
+    }
+    size_t bytes = size_t(cluster.triangles) * floatsPerTriangle * sizeof(float);
+#ifdef STREAM_MMAP
+    munmap((void *)cluster.data, bytes);
+#else
+    delete [] cluster.data;
+#endif
+    cluster.data = NULL;
+    mappedBytes_ -= bytes;
+}
+
+
+void StreamedObject::prefetch(Cluster const &cluster) const {
+#ifdef POSIX_FADV_WILLNEED
+    size_t bytes = size_t(cluster.triangles) * floatsPerTriangle * sizeof(float);
+    posix_fadvise(file_, cluster.offset, bytes, POSIX_FADV_WILLNEED);
+#endif
+}
+
+
+StreamedObject& StreamedObject::fromFile(std::string const &filename) {
+    // Retrieve the pack from the cache.
+    StreamedObject &obj = cache_[filename];
+    // Open it if it isn't already.
+    if (obj.file_ < 0) {
+        obj.open(filename);
+    }
+    return obj;
+}
+
+
+void StreamedObject::draw() {
+
+    TRACE_SCOPE("StreamedObject::draw");
+    frame_++;
+
+    // Draw each cluster that survives culling, mapping it in if need be.
+    for (int i = 0; i < clusters_.size(); i++) {
+        Cluster &c = clusters_[i];
+        if (!myIsBoxVisible(c.min[0], c.min[1], c.min[2], c.max[0], c.max[1], c.max[2])) {
+            continue;
+        }
+        if (!c.data && !map(c)) {
+            continue;
+        }
+        c.lastDrawn = frame_;
+
+        myBegin(GL_TRIANGLES);
+        float const *v = c.data;
+        for (unsigned j = 0; j < 3 * c.triangles; j++, v += 6) {
+            myNormal(v[3], v[4], v[5]);
+            myColor((v[3] + 1) / 2, (v[4] + 1) / 2, (v[5] + 1) / 2);
+            myVertex(v[0], v[1], v[2]);
+        }
+        myEnd();
+    }
+
+    // Read ahead the clusters the camera would see were it to keep moving
+    // the way it has since the last frame.
+    Vector eye = myEyePosition();
+    if (frame_ > 1) {
+        Vector motion = (eye - lastEye_) * prefetchFrames;
+        if (motion.length2() > 0) {
+            myPushMatrix();
+            myTranslate(-motion[0], -motion[1], -motion[2]);
+            for (int i = 0; i < clusters_.size(); i++) {
+                Cluster const &c = clusters_[i];
+                if (!c.data && myIsBoxVisible(c.min[0], c.min[1], c.min[2], c.max[0], c.max[1], c.max[2])) {
+                    prefetch(c);
+                }
+            }
+            myPopMatrix();
+        }
+    }
+    lastEye_ = eye;
+
+    // Drop the least recently drawn clusters until we are under the cap
+    // (which this frame's clusters alone may be over).
+    if (mappedBytes_ > streamMemoryCap) {
+        std::vector<std::pair<unsigned,int> > mapped;
+        for (int i = 0; i < clusters_.size(); i++) {
+            if (clusters_[i].data && clusters_[i].lastDrawn != frame_) {
+                mapped.push_back(std::make_pair(clusters_[i].lastDrawn, i));
+            }
+        }
+        std::sort(mapped.begin(), mapped.end());
+        for (int i = 0; i < mapped.size() && mappedBytes_ > streamMemoryCap; i++) {
+            unmap(clusters_[mapped[i].second]);
+        }
+    }
+}
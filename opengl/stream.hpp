@@ -0,0 +1,86 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "linalg.hpp"
+
+
+// Support for meshes too large to hold in memory. They are converted (once)
+// into a "cluster pack": a file holding the triangles split into spatial
+// clusters, each with its own bounding box, and each starting on its own
+// page. A StreamedObject draws a pack by mapping in only the clusters that
+// survive frustum culling. It keeps no more than a fixed number of bytes
+// mapped at once, dropping the least recently drawn clusters first, and asks
+// the OS to read ahead the clusters the camera is moving towards.
+
+
+// Converts an OBJ file into a cluster pack. Only positions and normals (as
+// floats) are held in memory, so the OBJ is read through four times. The
+// mesh is centered and resized just like Object does. Returns false if either
+// file could not be used.
+bool packOBJ(std::string const &objFilename, std::string const &packFilename);
+
+
+class StreamedObject {
+private:
+
+    // A cluster's bounds and where its triangles are in the file, and its
+    // triangles while they are mapped (or read) in.
+    struct Cluster {
+        float min[3], max[3];
+        unsigned long long offset;
+        unsigned triangles;
+        float const *data;
+        unsigned lastDrawn;
+    };
+
+    std::vector<Cluster> clusters_;
+
+    // The open pack, and the bytes of clusters mapped in.
+    int file_;
+    std::string filename_;
+    size_t mappedBytes_;
+
+    // Frames drawn so far, and where the eye was in the last one.
+    unsigned frame_;
+    Vector lastEye_;
+
+    // A mapping of filenames to already opened packs.
+    static std::map<std::string,StreamedObject> cache_;
+
+    // Read the cluster table of a pack.
+    bool open(std::string const &filename);
+
+    // Map a cluster in, or drop it.
+    bool map(Cluster &cluster);
+    void unmap(Cluster &cluster);
+
+    // Ask the OS to start reading a cluster in.
+    void prefetch(Cluster const &cluster) const;
+
+public:
+
+    StreamedObject() : file_(-1), mappedBytes_(0), frame_(0) {}
+    ~StreamedObject();
+
+    // The file and mappings are owned by a single StreamedObject.
+    StreamedObject(StreamedObject const &) = delete;
+    StreamedObject &operator=(StreamedObject const &) = delete;
+
+    // Opens a pack, or retrieves it from the cache if we have seen it before.
+    static StreamedObject& fromFile(std::string const &filename);
+
+    // Is there data here?
+    bool good() const { return clusters_.size(); }
+
+    // Draw the clusters that can be seen with the current matrices.
+    void draw();
+
+};
+
+
+#endif
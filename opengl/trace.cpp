@@ -0,0 +1,194 @@
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "trace.hpp"
+
+
+// Is recording on?
+static std::atomic<bool> enabled(false);
+
+
+// A single recorded zone, and the thread it was recorded on.
+struct TraceEvent {
+    char const *name;
+    double start, end;
+    int thread;
+};
+
+
+// A ring buffer of zones recorded by a single thread. Only the owning thread
+// pushes and only traceCollect() pops (one at a time), so the head and tail
+// are the only synchronization needed.
+class TraceRing {
+private:
+
+    static unsigned const capacity_ = 1 << 18;
+
+    std::vector<TraceEvent> events_;
+    std::atomic<unsigned> head_, tail_;
+
+public:
+
+    // A small number identifying the thread, and its name (if it was given).
+    int id_;
+    std::string name_;
+
+    // How many zones were dropped because the ring was full.
+    std::atomic<unsigned> dropped_;
+
+    TraceRing(int id) : events_(capacity_), head_(0), tail_(0), id_(id), dropped_(0) {}
+
+    // Add a zone, or drop it if the ring is full.
+    void push(TraceEvent const &event) {
+        unsigned head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) >= capacity_) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        events_[head % capacity_] = event;
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    // Move every zone in the ring onto the end of the given vector.
+    void drain(std::vector<TraceEvent> &out) {
+        unsigned tail = tail_.load(std::memory_order_relaxed);
+        unsigned head = head_.load(std::memory_order_acquire);
+        for (; tail != head; tail++) {
+            out.push_back(events_[tail % capacity_]);
+        }
+        tail_.store(tail, std::memory_order_release);
+    }
+
+};
+
+
+// Every thread's ring, and the zones collected from them. Rings are never
+// freed, as a thread may exit before its zones are collected.
+static std::mutex ringsMutex;
+static std::vector<TraceRing*> rings;
+
+static std::mutex collectedMutex;
+static std::vector<TraceEvent> collected;
+
+// The calling thread's name, and ring (created the first time it records).
+static thread_local char const *threadName = NULL;
+static thread_local TraceRing *threadRing = NULL;
+
+
+void traceEnable(bool value) {
+    enabled.store(value, std::memory_order_relaxed);
+}
+
+
+bool traceIsEnabled() {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+
+void traceThreadName(char const *name) {
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    threadName = name;
+    if (threadRing) {
+        threadRing->name_ = name;
+    }
+}
+
+
+double traceNow() {
+    return std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+
+void traceZone(char const *name, double start, double end) {
+    if (!threadRing) {
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        threadRing = new TraceRing(rings.size() + 1);
+        if (threadName) {
+            threadRing->name_ = threadName;
+        }
+        rings.push_back(threadRing);
+    }
+    TraceEvent event = {name, start, end, threadRing->id_};
+    threadRing->push(event);
+}
+
+
+void traceCollect() {
+    std::lock_guard<std::mutex> ringsLock(ringsMutex);
+    std::lock_guard<std::mutex> collectedLock(collectedMutex);
+    for (int i = 0; i < rings.size(); i++) {
+        rings[i]->drain(collected);
+    }
+}
+
+
+// Writes a string as a JSON string literal.
+static void writeString(std::ostream &out, std::string const &value) {
+    out << '"';
+    for (int i = 0; i < value.size(); i++) {
+        if (value[i] == '"' || value[i] == '\\') {
+            out << '\\';
+        }
+        out << value[i];
+    }
+    out << '"';
+}
+
+
+bool traceWrite(std::string const &filename) {
+
+    traceCollect();
+
+    std::ofstream file(filename.c_str());
+    if (!file.good()) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> ringsLock(ringsMutex);
+    std::lock_guard<std::mutex> collectedLock(collectedMutex);
+
+    file << "{\"traceEvents\": [\n";
+    char const *separator = "";
+
+    // Name the threads, and note any zones that were dropped.
+    for (int i = 0; i < rings.size(); i++) {
+        TraceRing const &ring = *rings[i];
+        std::string name = ring.name_.size() ? ring.name_ : "thread";
+        if (ring.dropped_) {
+            char note[64];
+            snprintf(note, sizeof(note), " (%u zones dropped)", unsigned(ring.dropped_));
+            name += note;
+        }
+        file << separator << "{\"ph\": \"M\", \"pid\": 1, \"tid\": " << ring.id_ <<
+            ", \"name\": \"thread_name\", \"args\": {\"name\": ";
+        writeString(file, name);
+        file << "}}";
+        separator = ",\n";
+    }
+
+    // Every zone as a "complete" event.
+    file.precision(3);
+    file << std::fixed;
+    for (int i = 0; i < collected.size(); i++) {
+        TraceEvent const &event = collected[i];
+        file << separator << "{\"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread <<
+            ", \"ts\": " << event.start << ", \"dur\": " << event.end - event.start <<
+            ", \"name\": ";
+        writeString(file, event.name);
+        file << "}";
+        separator = ",\n";
+    }
+
+    file << "\n]}\n";
+    collected.clear();
+
+    return !file.fail();
+}
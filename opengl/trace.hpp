@@ -0,0 +1,74 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+
+#include <string>
+
+
+// A small tracer that records how long named zones of code take on each
+// thread, and writes them out in the Chrome trace event format (which can be
+// opened in chrome://tracing or Perfetto).
+//
+// Each thread records into its own fixed-size ring buffer without taking any
+// locks; traceCollect() drains the rings, and traceWrite() writes out
+// everything collected. When tracing is disabled a zone costs one flag test.
+
+
+// Turns recording on or off. It starts off.
+void traceEnable(bool enabled);
+
+// Is recording on?
+bool traceIsEnabled();
+
+// Names the calling thread in the trace.
+void traceThreadName(char const *name);
+
+// Records a zone on the calling thread. The name must be a string literal (or
+// otherwise live forever); times are in microseconds from traceNow().
+void traceZone(char const *name, double start, double end);
+
+// Microseconds since an arbitrary fixed point in time.
+double traceNow();
+
+// Moves recorded zones out of every thread's ring buffer. Call this now and
+// then while tracing (e.g. once a frame), or zones will be dropped when a
+// ring fills up.
+void traceCollect();
+
+// Writes everything collected so far (after collecting once more) to the
+// given file as Chrome trace JSON, and forgets it. Returns false if the file
+// could not be written.
+bool traceWrite(std::string const &filename);
+
+
+// Records a zone covering its own lifetime, i.e. the enclosing scope.
+class TraceScope {
+private:
+
+    char const *name_;
+    double start_;
+
+public:
+
+    TraceScope(char const *name) : name_(name), start_(-1) {
+        if (traceIsEnabled()) {
+            start_ = traceNow();
+        }
+    }
+
+    ~TraceScope() {
+        if (start_ >= 0) {
+            traceZone(name_, start_, traceNow());
+        }
+    }
+
+};
+
+
+// Traces the rest of the enclosing scope as a zone with the given name.
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope_, __LINE__)(name)
+
+
+#endif